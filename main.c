@@ -1,14 +1,21 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "stb_truetype.h"
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libinput.h>
 #include <libtsm.h>
 #include <libudev.h>
 #include <linux/fb.h>
+#include <linux/input-event-codes.h>
 #include <linux/kd.h>
 #include <linux/vt.h>
+#include <math.h>
 #include <poll.h>
 #include <pty.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,22 +23,46 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <xkbcommon/xkbcommon.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 extern unsigned char font_ttf[];
 extern unsigned int font_ttf_len;
 
 static volatile sig_atomic_t running = 1;
 static volatile sig_atomic_t force_refresh = 0;
+static volatile sig_atomic_t vt_release_req = 0, vt_acquire_req = 0;
+static volatile sig_atomic_t stats_req = 0;
+static volatile sig_atomic_t child_req = 0;
 static int fb_fd = -1, pty_master = -1;
 static pid_t child_pid = -1;
 static int active_vt = -1;
-static uint32_t *fb_mem = MAP_FAILED;
+static int vt_fd = -1;
+
+#define INHIBIT_VT 0x1
+#define INHIBIT_BLANK 0x2
+static unsigned int render_inhibit;
+
+static int blank_timeout = 0;
+static int blank_tfd = -1;
+static int blanked_by_us = 0;
+static int bl_power_fd = -1, bl_bright_fd = -1;
+static double blank_checked_ms;
+static uint8_t *fb_mem = MAP_FAILED;
+static uint8_t *fb_shadow = NULL;
+static uint8_t *fb_draw;
+static int dirty_y0, dirty_y1;
 static struct fb_var_screeninfo vinfo;
 static struct fb_fix_screeninfo finfo;
 static int fb_w, fb_h, fb_stride;
-static int fb_stride_pixels;
+static int clip_y0, clip_y1;
 static stbtt_fontinfo font;
 static float font_scale;
 static unsigned char *font_data = NULL;
@@ -42,6 +73,24 @@ static int term_cols, term_rows;
 static int cell_w, cell_h;
 static int term_height;
 
+struct cell {
+    uint32_t ch;
+    uint32_t fg, bg;
+    uint8_t width;
+    uint8_t flags;
+};
+
+#define CELL_BOLD 0x01
+#define CELL_UNDERLINE 0x02
+#define CELL_BLINK 0x04
+
+static struct cell *screen_cells, *screen_next, *row_buf;
+static char *row_text;
+static uint64_t *row_hash, *row_hash_next;
+static uint64_t *drawn_id;
+static int drawn_valid;
+static int out_shift;
+
 #define GLYPH_CACHE_SIZE 256
 static struct {
     unsigned char *bitmap;
@@ -50,17 +99,69 @@ static struct {
     int valid;
 } glyph_cache[GLYPH_CACHE_SIZE];
 
-#define ROWS 5
-#define COLS 12
 static int kh = 52;
 static int current_font_size = 26;
 static int kw;
 static int kb_y, kb_height;
 
+/* The on-screen keyboard gives way to a hardware keyboard once one is
+ * typed on, unless --osk always. The Hide key (Shift+Esc) collapses it to
+ * a thin handle that brings it back when tapped. */
+enum { OSK_AUTO, OSK_ALWAYS };
+static int osk_mode = OSK_AUTO;
+static int osk_hidden, osk_collapsed;
+
 static int shift_on, ctrl_on, alt_on;
-static int pressed_row = -1, pressed_col = -1;
-static int last_touch_y = -1;
+static int pressed_key = -1;
+
+/* Holding Space turns it into a trackpad whose finger travel is sent as
+ * arrow keys, one per cell of movement. */
+#define LONG_PRESS_MS 300
+static int press_tfd = -1;
+static struct {
+    int armed, active;
+    int x0, y0, x, y;
+} pad;
+
+static struct {
+    int down, col, row, x, y;
+} mouse;
+
+/* Holding a key that has alternates opens a row of them above it, drawn
+ * over a saved copy of the pixels it covers. Sliding picks one and letting
+ * go types it. */
+#define POPUP_MAX 16
+static struct {
+    int armed, shown, key;
+    const char *alts;
+    const char *alt[POPUP_MAX];
+    int alt_len[POPUP_MAX];
+    int n, sel, finger_x;
+    int x, y, w, h, cw;
+    uint8_t *under;
+    size_t under_cap;
+} popup;
+
+/* On the alternate screen there is no history to drag through, so a drag
+ * is sent to the application as arrow keys or wheel events instead. */
+#define ALT_SCROLL_RATE 60
+#define ALT_SCROLL_BURST 10
+
+enum { ALT_SCROLL_OFF, ALT_SCROLL_ARROWS, ALT_SCROLL_WHEEL };
+
+static int alt_scroll = ALT_SCROLL_ARROWS;
+static struct {
+    int active, wheel, moved;
+    int x, y, y0, ay;
+    double tokens, t;
+} alt;
+static int repeat_delay = 400, repeat_rate = 25;
+static int term_damaged = 0;
+static int last_touch_y = -1, touch_y = -1;
 static int sb_count = 0;
+static int sb_max = 10000;
+static const char *sb_spill_dir;
+static int scroll_px = 0;
 
 struct key_info {
     const char *label;
@@ -69,16 +170,153 @@ struct key_info {
     uint32_t keysym_shift;
     int label_w;
     int label_shift_w;
+    float width;
+    const char *text;
+    const char *text_shift;
+    const char *alts;
+    const char *alts_shift;
+    int layer;
+    int row, x, w;
+};
+
+#define KEY(l, ls, s, ss) {.label = l, .label_shift = ls, .keysym = s, .keysym_shift = ss}
+#define KEYW(l, s, w) {.label = l, .label_shift = l, .keysym = s, .keysym_shift = s, .width = w}
+#define LAYER_KEY(l, n) {.label = l, .label_shift = l, .layer = (n) + 1}
+
+/* Rows end with an empty entry. Keys are one unit wide unless they say
+ * otherwise; --layout replaces this table with one read from a file. */
+static struct key_info default_keys[] = {
+    KEY("Esc", "Hide", 0xff1b, 0x1008ff2c), KEY("1", "!", '1', '!'), KEY("2", "@", '2', '@'), KEY("3", "#", '3', '#'), KEY("4", "$", '4', '$'), KEY("5", "%", '5', '%'), KEY("6", "^", '6', '^'), KEY("7", "&", '7', '&'), KEY("8", "*", '8', '*'), KEY("9", "(", '9', '('), KEY("0", ")", '0', ')'), KEY("Bksp", "Bksp", 0x007f, 0x007f), {0},
+    KEY("Tab", "Tab", 0xff09, 0xff09), KEY("q", "Q", 'q', 'Q'), KEY("w", "W", 'w', 'W'), KEY("e", "E", 'e', 'E'), KEY("r", "R", 'r', 'R'), KEY("t", "T", 't', 'T'), KEY("y", "Y", 'y', 'Y'), KEY("u", "U", 'u', 'U'), KEY("i", "I", 'i', 'I'), KEY("o", "O", 'o', 'O'), KEY("p", "P", 'p', 'P'), KEY("\\", "|", '\\', '|'), {0},
+    KEY("Ctrl", "Ctrl", 0xffe3, 0xffe3), KEY("a", "A", 'a', 'A'), KEY("s", "S", 's', 'S'), KEY("d", "D", 'd', 'D'), KEY("f", "F", 'f', 'F'), KEY("g", "G", 'g', 'G'), KEY("h", "H", 'h', 'H'), KEY("j", "J", 'j', 'J'), KEY("k", "K", 'k', 'K'), KEY("l", "L", 'l', 'L'), KEY(";", ":", ';', ':'), KEY("Ent", "Ent", 0xff0d, 0xff0d), {0},
+    KEY("Shft", "Shft", 0xffe1, 0xffe1), KEY("z", "Z", 'z', 'Z'), KEY("x", "X", 'x', 'X'), KEY("c", "C", 'c', 'C'), KEY("v", "V", 'v', 'V'), KEY("b", "B", 'b', 'B'), KEY("n", "N", 'n', 'N'), KEY("m", "M", 'm', 'M'), KEY(",", "<", ',', '<'), KEY(".", ">", '.', '>'), KEY("/", "?", '/', '?'), KEY("Shft", "Shft", 0xffe2, 0xffe2), {0},
+    KEY("Alt", "Alt", 0xffe9, 0xffe9), LAYER_KEY("Fn", 1), KEY("-", "_", '-', '_'), KEY("=", "+", '=', '+'), KEY("[", "{", '[', '{'), KEY("]", "}", ']', '}'), {.label = "Space", .label_shift = "Paste", .keysym = ' ', .keysym_shift = 0x1008ff6d, .width = 2}, KEY("'", "\"", '\'', '"'), KEY("Up", "Up", 0xff52, 0xff52), KEY("Dn", "Dn", 0xff54, 0xff54), KEY("Lt", "Lt", 0xff51, 0xff51), KEY("Rt", "Rt", 0xff53, 0xff53), {0},
+};
+
+static struct key_info fn_keys[] = {
+    KEYW("F1", 0xffbe, 2), KEYW("F2", 0xffbf, 2), KEYW("F3", 0xffc0, 2), KEYW("F4", 0xffc1, 2), KEYW("F5", 0xffc2, 2), KEYW("F6", 0xffc3, 2), {0},
+    KEYW("F7", 0xffc4, 2), KEYW("F8", 0xffc5, 2), KEYW("F9", 0xffc6, 2), KEYW("F10", 0xffc7, 2), KEYW("F11", 0xffc8, 2), KEYW("F12", 0xffc9, 2), {0},
+    KEYW("Esc", 0xff1b, 1), KEYW("Tab", 0xff09, 1), KEYW("Ins", 0xff63, 1), KEYW("Del", 0xffff, 1), KEYW("Home", 0xff50, 1), KEYW("End", 0xff57, 1), KEYW("PgUp", 0xff55, 1), KEYW("PgDn", 0xff56, 1), KEYW("Bksp", 0x007f, 2), {0},
+    KEYW("Shft", 0xffe1, 2), KEYW("Ctrl", 0xffe3, 2), KEYW("Alt", 0xffe9, 2), KEYW("Ent", 0xff0d, 4), {0},
+    LAYER_KEY("Abc", 0), LAYER_KEY("Sym", 2), LAYER_KEY("Nav", 3), KEYW("Space", ' ', 3), KEYW("Lt", 0xff51, 1), KEYW("Up", 0xff52, 1), KEYW("Dn", 0xff54, 1), KEYW("Rt", 0xff53, 1), {0},
+};
+
+static struct key_info sym_keys[] = {
+    KEYW("!", '!', 1), KEYW("@", '@', 1), KEYW("#", '#', 1), KEYW("$", '$', 1), KEYW("%", '%', 1), KEYW("^", '^', 1), KEYW("&", '&', 1), KEYW("*", '*', 1), KEYW("(", '(', 1), KEYW(")", ')', 1), KEYW("Bksp", 0x007f, 2), {0},
+    KEYW("`", '`', 1), KEYW("~", '~', 1), KEYW("|", '|', 1), KEYW("\\", '\\', 1), KEYW("{", '{', 1), KEYW("}", '}', 1), KEYW("[", '[', 1), KEYW("]", ']', 1), KEYW("<", '<', 1), KEYW(">", '>', 1), KEYW("Tab", 0xff09, 2), {0},
+    KEYW("+", '+', 1), KEYW("-", '-', 1), KEYW("*", '*', 1), KEYW("/", '/', 1), KEYW("=", '=', 1), KEYW("_", '_', 1), KEYW(":", ':', 1), KEYW(";", ';', 1), KEYW("\"", '"', 1), KEYW("'", '\'', 1), KEYW("Ent", 0xff0d, 2), {0},
+    KEYW("Ctrl", 0xffe3, 2), KEYW("Alt", 0xffe9, 2), KEYW("?", '?', 1), KEYW(",", ',', 1), KEYW(".", '.', 1), KEYW("Esc", 0xff1b, 2), {0},
+    LAYER_KEY("Abc", 0), LAYER_KEY("Fn", 1), LAYER_KEY("Nav", 3), KEYW("Space", ' ', 3), KEYW("Lt", 0xff51, 1), KEYW("Up", 0xff52, 1), KEYW("Dn", 0xff54, 1), KEYW("Rt", 0xff53, 1), {0},
 };
 
-static struct key_info keyboard_layout[ROWS][COLS] = {
-    {{"Esc", "Esc", 0xff1b, 0xff1b, 0, 0}, {"1", "!", '1', '!', 0, 0}, {"2", "@", '2', '@', 0, 0}, {"3", "#", '3', '#', 0, 0}, {"4", "$", '4', '$', 0, 0}, {"5", "%", '5', '%', 0, 0}, {"6", "^", '6', '^', 0, 0}, {"7", "&", '7', '&', 0, 0}, {"8", "*", '8', '*', 0, 0}, {"9", "(", '9', '(', 0, 0}, {"0", ")", '0', ')', 0, 0}, {"Bksp", "Bksp", 0x007f, 0x007f, 0, 0}},
-    {{"Tab", "Tab", 0xff09, 0xff09, 0, 0}, {"q", "Q", 'q', 'Q', 0, 0}, {"w", "W", 'w', 'W', 0, 0}, {"e", "E", 'e', 'E', 0, 0}, {"r", "R", 'r', 'R', 0, 0}, {"t", "T", 't', 'T', 0, 0}, {"y", "Y", 'y', 'Y', 0, 0}, {"u", "U", 'u', 'U', 0, 0}, {"i", "I", 'i', 'I', 0, 0}, {"o", "O", 'o', 'O', 0, 0}, {"p", "P", 'p', 'P', 0, 0}, {"\\", "|", '\\', '|', 0, 0}},
-    {{"Ctrl", "Ctrl", 0xffe3, 0xffe3, 0, 0}, {"a", "A", 'a', 'A', 0, 0}, {"s", "S", 's', 'S', 0, 0}, {"d", "D", 'd', 'D', 0, 0}, {"f", "F", 'f', 'F', 0, 0}, {"g", "G", 'g', 'G', 0, 0}, {"h", "H", 'h', 'H', 0, 0}, {"j", "J", 'j', 'J', 0, 0}, {"k", "K", 'k', 'K', 0, 0}, {"l", "L", 'l', 'L', 0, 0}, {";", ":", ';', ':', 0, 0}, {"Ent", "Ent", 0xff0d, 0xff0d, 0, 0}},
-    {{"Shft", "Shft", 0xffe1, 0xffe1, 0, 0}, {"z", "Z", 'z', 'Z', 0, 0}, {"x", "X", 'x', 'X', 0, 0}, {"c", "C", 'c', 'C', 0, 0}, {"v", "V", 'v', 'V', 0, 0}, {"b", "B", 'b', 'B', 0, 0}, {"n", "N", 'n', 'N', 0, 0}, {"m", "M", 'm', 'M', 0, 0}, {",", "<", ',', '<', 0, 0}, {".", ">", '.', '>', 0, 0}, {"/", "?", '/', '?', 0, 0}, {"Shft", "Shft", 0xffe2, 0xffe2, 0, 0}},
-    {{"Alt", "Alt", 0xffe9, 0xffe9, 0, 0}, {"-", "_", '-', '_', 0, 0}, {"=", "+", '=', '+', 0, 0}, {"[", "{", '[', '{', 0, 0}, {"]", "}", ']', '}', 0, 0}, {"Space", "Space", ' ', ' ', 0, 0}, {"", "", ' ', ' ', 0, 0}, {"'", "\"", '\'', '"', 0, 0}, {"Up", "Up", 0xff52, 0xff52, 0, 0}, {"Dn", "Dn", 0xff54, 0xff54, 0, 0}, {"Lt", "Lt", 0xff51, 0xff51, 0, 0}, {"Rt", "Rt", 0xff53, 0xff53, 0, 0}}
+static struct key_info nav_keys[] = {
+    KEYW("Esc", 0xff1b, 1), KEYW("Home", 0xff50, 1), KEYW("Up", 0xff52, 1), KEYW("End", 0xff57, 1), KEYW("PgUp", 0xff55, 1), {0},
+    KEYW("Tab", 0xff09, 1), KEYW("Lt", 0xff51, 1), KEYW("Dn", 0xff54, 1), KEYW("Rt", 0xff53, 1), KEYW("PgDn", 0xff56, 1), {0},
+    KEYW("Ins", 0xff63, 1), KEYW("Del", 0xffff, 1), KEYW("Bksp", 0x007f, 1), KEYW("Ent", 0xff0d, 2), {0},
+    KEYW("Shft", 0xffe1, 1), KEYW("Ctrl", 0xffe3, 1), KEYW("Alt", 0xffe9, 1), KEYW("Space", ' ', 2), {0},
+    LAYER_KEY("Abc", 0), LAYER_KEY("Fn", 1), LAYER_KEY("Sym", 2), KEYW("Prev", 0x1008ff26, 1), KEYW("Next", 0x1008ff27, 1), {0},
 };
 
+/* Alternates for keys that do not list their own, by keysym. */
+static const struct {
+    uint32_t keysym;
+    const char *alts;
+} default_alts[] = {
+    {'a', "à á â ä æ ã å ā"}, {'A', "À Á Â Ä Æ Ã Å Ā"},
+    {'c', "ç ć č"}, {'C', "Ç Ć Č"},
+    {'d', "ð ď"}, {'D', "Ð Ď"},
+    {'e', "è é ê ë ē ę ě"}, {'E', "È É Ê Ë Ē Ę Ě"},
+    {'g', "ğ"}, {'G', "Ğ"},
+    {'i', "ì í î ï ī ı"}, {'I', "Ì Í Î Ï Ī İ"},
+    {'l', "ł"}, {'L', "Ł"},
+    {'n', "ñ ń ň"}, {'N', "Ñ Ń Ň"},
+    {'o', "ò ó ô ö õ ø œ ō"}, {'O', "Ò Ó Ô Ö Õ Ø Œ Ō"},
+    {'r', "ř"}, {'R', "Ř"},
+    {'s', "ß ś š ş"}, {'S', "Ś Š Ş"},
+    {'t', "þ ť"}, {'T', "Þ Ť"},
+    {'u', "ù ú û ü ū ů"}, {'U', "Ù Ú Û Ü Ū Ů"},
+    {'y', "ý ÿ"}, {'Y', "Ý Ÿ"},
+    {'z', "ź ż ž"}, {'Z', "Ź Ż Ž"},
+    {'-', "– — ·"}, {'$', "€ £ ¥ ¢"}, {'!', "¡"}, {'?', "¿"},
+    {'\'', "‘ ’ ‚"}, {'"', "“ ” „ « »"}, {'.', "… •"},
+    {'*', "×"}, {'/', "÷"}, {'+', "±"}, {'=', "≠ ≈"}, {'<', "≤ «"}, {'>', "≥ »"}, {'0', "°"},
+};
+
+/* Keyboard layers, of which kb is the one shown. In each, hit maps every
+ * pixel column of every row to its key, and img holds the whole layer drawn
+ * with no key down, unshifted and shifted, so most redraws and every layer
+ * switch are copies. All layers are kb_rows high. */
+#define KB_MAX_LAYERS 8
+#define KB_LAYER(k) {.keys = k, .nkeys = sizeof(k) / sizeof(k[0])}
+
+static struct kb_layer {
+    struct key_info *keys;
+    int nkeys;
+    uint16_t *hit;
+    uint8_t *img[2];
+} kb_layers[KB_MAX_LAYERS] = {KB_LAYER(default_keys), KB_LAYER(fn_keys), KB_LAYER(sym_keys), KB_LAYER(nav_keys)};
+static int kb_nlayers = 4, kb_rows;
+static int kb_loaded;
+static struct kb_layer *kb = kb_layers;
+
+enum pixfmt { PF_XRGB8888, PF_XBGR8888, PF_RGB565, PF_BGR565, PF_RGB888, PF_BGR888 };
+
+#define PF_INLINE static inline __attribute__((always_inline))
+#define PX_SIZE(pf) ((pf) == PF_RGB565 || (pf) == PF_BGR565 ? 2 : (pf) == PF_RGB888 || (pf) == PF_BGR888 ? 3 : 4)
+
+/* Colors are passed around as 0xffRRGGBB and only converted to the panel's
+ * native layout inside the kernels below. Each kernel is instantiated once
+ * per format so the format switch folds away at compile time. */
+PF_INLINE uint32_t px_pack(enum pixfmt pf, uint32_t c) {
+    uint32_t r = (c >> 16) & 0xff, g = (c >> 8) & 0xff, b = c & 0xff;
+    switch (pf) {
+    case PF_XBGR8888: return 0xff000000 | (b << 16) | (g << 8) | r;
+    case PF_RGB565: return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    case PF_BGR565: return ((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3);
+    case PF_RGB888: return (r << 16) | (g << 8) | b;
+    case PF_BGR888: return (b << 16) | (g << 8) | r;
+    default: return 0xff000000 | c;
+    }
+}
+
+PF_INLINE uint32_t px_unpack(enum pixfmt pf, uint32_t v) {
+    uint32_t r, g, b;
+    switch (pf) {
+    case PF_XBGR8888:
+    case PF_BGR888:
+        r = v & 0xff; g = (v >> 8) & 0xff; b = (v >> 16) & 0xff;
+        break;
+    case PF_RGB565:
+        r = (v >> 11) & 0x1f; g = (v >> 5) & 0x3f; b = v & 0x1f;
+        r = (r << 3) | (r >> 2); g = (g << 2) | (g >> 4); b = (b << 3) | (b >> 2);
+        break;
+    case PF_BGR565:
+        b = (v >> 11) & 0x1f; g = (v >> 5) & 0x3f; r = v & 0x1f;
+        r = (r << 3) | (r >> 2); g = (g << 2) | (g >> 4); b = (b << 3) | (b >> 2);
+        break;
+    default:
+        r = (v >> 16) & 0xff; g = (v >> 8) & 0xff; b = v & 0xff;
+        break;
+    }
+    return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+PF_INLINE uint32_t px_load(enum pixfmt pf, const uint8_t *p) {
+    switch (pf) {
+    case PF_RGB565: case PF_BGR565: return *(const uint16_t *)p;
+    case PF_RGB888: case PF_BGR888: return p[0] | (p[1] << 8) | (p[2] << 16);
+    default: return *(const uint32_t *)p;
+    }
+}
+
+PF_INLINE void px_store(enum pixfmt pf, uint8_t *p, uint32_t v) {
+    switch (pf) {
+    case PF_RGB565: case PF_BGR565: *(uint16_t *)p = v; break;
+    case PF_RGB888: case PF_BGR888: p[0] = v; p[1] = v >> 8; p[2] = v >> 16; break;
+    default: *(uint32_t *)p = v; break;
+    }
+}
+
 static inline uint32_t blend_alpha(uint32_t src, uint32_t dst, unsigned char alpha) {
     uint32_t sr = (src >> 16) & 0xff, sg = (src >> 8) & 0xff, sb = src & 0xff;
     uint32_t dr = (dst >> 16) & 0xff, dg = (dst >> 8) & 0xff, db = dst & 0xff;
@@ -88,42 +326,152 @@ static inline uint32_t blend_alpha(uint32_t src, uint32_t dst, unsigned char alp
     return 0xff000000 | (r << 16) | (g << 8) | b;
 }
 
-static void fill_rect(int x, int y, int w, int h, uint32_t color) {
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
-    if (x + w > fb_w) w = fb_w - x;
-    if (y + h > fb_h) h = fb_h - y;
-    if (w <= 0 || h <= 0) return;
+PF_INLINE void fill_pf(enum pixfmt pf, uint8_t *dst, int stride, int w, int h, uint32_t color) {
+    uint32_t v = px_pack(pf, color);
+    int bpp = PX_SIZE(pf);
+    for (int j = 0; j < h; j++, dst += stride) {
+        uint8_t *p = dst;
+        for (int i = 0; i < w; i++, p += bpp)
+            px_store(pf, p, v);
+    }
+}
 
-    for (int j = 0; j < h; j++) {
-        int screen_y = y + j;
-        uint32_t *dst = fb_mem + screen_y * fb_stride_pixels;
-        for (int i = 0; i < w; i++) {
-            dst[x + i] = color;
+PF_INLINE void blend_pf(enum pixfmt pf, uint8_t *dst, int stride, const unsigned char *bmp,
+                        int bmp_stride, int w, int h, uint32_t fg) {
+    uint32_t v = px_pack(pf, fg);
+    int bpp = PX_SIZE(pf);
+    for (int j = 0; j < h; j++, dst += stride, bmp += bmp_stride) {
+        uint8_t *p = dst;
+        for (int i = 0; i < w; i++, p += bpp) {
+            unsigned char alpha = bmp[i];
+            if (alpha == 0) continue;
+            if (alpha == 255)
+                px_store(pf, p, v);
+            else
+                px_store(pf, p, px_pack(pf, blend_alpha(fg, px_unpack(pf, px_load(pf, p)), alpha)));
         }
     }
 }
 
-static void draw_bitmap(int x, int y, const unsigned char *bmp, int bw, int bh, uint32_t fg_color) {
-    for (int j = 0; j < bh; j++) {
-        int screen_y = y + j;
-        if (screen_y < 0 || screen_y >= fb_h) continue;
+struct pixfmt_ops {
+    const char *name;
+    int bpp;
+    void (*fill)(uint8_t *dst, int stride, int w, int h, uint32_t color);
+    void (*blend)(uint8_t *dst, int stride, const unsigned char *bmp, int bmp_stride,
+                  int w, int h, uint32_t fg);
+};
 
-        uint32_t *dst = fb_mem + screen_y * fb_stride_pixels;
-        for (int i = 0; i < bw; i++) {
-            int dpx = x + i;
-            if (dpx < 0 || dpx >= fb_w) continue;
+#define PIXFMT_OPS(id, pf) \
+    static void fill_##id(uint8_t *dst, int stride, int w, int h, uint32_t color) { \
+        fill_pf(pf, dst, stride, w, h, color); \
+    } \
+    static void blend_##id(uint8_t *dst, int stride, const unsigned char *bmp, int bmp_stride, \
+                           int w, int h, uint32_t fg) { \
+        blend_pf(pf, dst, stride, bmp, bmp_stride, w, h, fg); \
+    } \
+    static const struct pixfmt_ops pix_##id = {#id, PX_SIZE(pf), fill_##id, blend_##id};
 
-            unsigned char alpha = bmp[j * bw + i];
-            if (alpha == 0) continue;
+PIXFMT_OPS(xrgb8888, PF_XRGB8888)
+PIXFMT_OPS(xbgr8888, PF_XBGR8888)
+PIXFMT_OPS(rgb565, PF_RGB565)
+PIXFMT_OPS(bgr565, PF_BGR565)
+PIXFMT_OPS(rgb888, PF_RGB888)
+PIXFMT_OPS(bgr888, PF_BGR888)
 
-            if (alpha == 255) {
-                dst[dpx] = fg_color;
-            } else {
-                dst[dpx] = blend_alpha(fg_color, dst[dpx], alpha);
-            }
-        }
+static const struct pixfmt_ops *pix = &pix_xrgb8888;
+
+/* Red in the low bits means a BGR panel, at any depth. */
+static int pixfmt_select(void) {
+    int bgr = vinfo.blue.offset > vinfo.red.offset;
+    switch (vinfo.bits_per_pixel) {
+    case 32:
+        pix = bgr ? &pix_xbgr8888 : &pix_xrgb8888;
+        return 0;
+    case 24:
+        pix = bgr ? &pix_bgr888 : &pix_rgb888;
+        return 0;
+    case 16:
+        pix = bgr ? &pix_bgr565 : &pix_rgb565;
+        return 0;
     }
+    fprintf(stderr, "touchvt: unsupported framebuffer depth %u\n", vinfo.bits_per_pixel);
+    return -1;
+}
+
+static inline void mark_dirty(int y, int h) {
+    if (dirty_y0 >= dirty_y1) {
+        dirty_y0 = y;
+        dirty_y1 = y + h;
+        return;
+    }
+    if (y < dirty_y0) dirty_y0 = y;
+    if (y + h > dirty_y1) dirty_y1 = y + h;
+}
+
+/* The framebuffer is usually mapped write-combined, so it is filled with
+ * aligned 64-byte non-temporal stores that bypass the cache instead of the
+ * scattered per-cell writes the renderer produces. */
+static void stream_copy(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t head = (-(uintptr_t)dst) & 63;
+    if (head > len) head = len;
+    memcpy(dst, src, head);
+    dst += head; src += head; len -= head;
+
+#if defined(__SSE2__)
+    for (; len >= 64; len -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    _mm_sfence();
+#elif defined(__aarch64__)
+    for (; len >= 64; len -= 64, dst += 64, src += 64) {
+        __asm__ volatile("ldp q0, q1, [%1]\n\t"
+                         "ldp q2, q3, [%1, #32]\n\t"
+                         "stnp q0, q1, [%0]\n\t"
+                         "stnp q2, q3, [%0, #32]\n\t"
+                         : : "r"(dst), "r"(src) : "v0", "v1", "v2", "v3", "memory");
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+static void fb_flush(void) {
+    if (dirty_y0 >= dirty_y1 || render_inhibit) return;
+    if (fb_draw != fb_mem) {
+        size_t off = (size_t)dirty_y0 * fb_stride;
+        stream_copy(fb_mem + off, fb_draw + off, (size_t)(dirty_y1 - dirty_y0) * fb_stride);
+    }
+    dirty_y0 = dirty_y1 = 0;
+}
+
+static void fill_rect(int x, int y, int w, int h, uint32_t color) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < clip_y0) { h -= clip_y0 - y; y = clip_y0; }
+    if (x + w > fb_w) w = fb_w - x;
+    if (y + h > clip_y1) h = clip_y1 - y;
+    if (w <= 0 || h <= 0) return;
+
+    pix->fill(fb_draw + y * fb_stride + x * pix->bpp, fb_stride, w, h, color);
+    mark_dirty(y, h);
+}
+
+static void draw_bitmap(int x, int y, const unsigned char *bmp, int bw, int bh, uint32_t fg_color) {
+    int sx = 0, sy = 0, w = bw, h = bh;
+    if (x < 0) { sx = -x; w += x; x = 0; }
+    if (y < clip_y0) { sy = clip_y0 - y; h -= sy; y = clip_y0; }
+    if (x + w > fb_w) w = fb_w - x;
+    if (y + h > clip_y1) h = clip_y1 - y;
+    if (w <= 0 || h <= 0) return;
+
+    pix->blend(fb_draw + y * fb_stride + x * pix->bpp, fb_stride,
+               bmp + sy * bw + sx, bw, w, h, fg_color);
+    mark_dirty(y, h);
 }
 
 static void sig_handler(int sig) {
@@ -136,6 +484,21 @@ static void sigusr1_handler(int sig) {
     force_refresh = 1;
 }
 
+static void sigusr2_handler(int sig) {
+    (void)sig;
+    stats_req = 1;
+}
+
+static void vt_release_handler(int sig) {
+    (void)sig;
+    vt_release_req = 1;
+}
+
+static void vt_acquire_handler(int sig) {
+    (void)sig;
+    vt_acquire_req = 1;
+}
+
 static void glyph_cache_clear(void) {
     for (int i = 0; i < GLYPH_CACHE_SIZE; i++) {
         if (glyph_cache[i].bitmap) {
@@ -171,9 +534,7 @@ static unsigned char *glyph_cache_get(uint32_t ch, int *w, int *h, int *xoff, in
 
 static void sigchld_handler(int sig) {
     (void)sig;
-    int status;
-    if (waitpid(child_pid, &status, WNOHANG) > 0)
-        running = 0;
+    child_req = 1;
 }
 
 static unsigned char *load_font_file(const char *path) {
@@ -198,234 +559,3304 @@ static unsigned char *load_font_file(const char *path) {
     return data;
 }
 
+/* Everything bound for the PTY is queued and written once per loop
+ * iteration, so a burst of key repeats becomes a single write. */
+static struct {
+    char *buf;
+    size_t len, cap;
+} pty_out;
+
+static void pty_queue(const char *u8, size_t len) {
+    if (pty_out.len + len > pty_out.cap) {
+        size_t cap = pty_out.cap ? pty_out.cap : 4096;
+        while (cap < pty_out.len + len)
+            cap *= 2;
+        char *buf = realloc(pty_out.buf, cap);
+        if (!buf) {
+            fprintf(stderr, "touchvt: pty queue: out of memory\n");
+            return;
+        }
+        pty_out.buf = buf;
+        pty_out.cap = cap;
+    }
+    memcpy(pty_out.buf + pty_out.len, u8, len);
+    pty_out.len += len;
+}
+
 static void vte_write_cb(struct tsm_vte *vte, const char *u8, size_t len, void *data) {
     (void)vte; (void)data;
-    if (write(pty_master, u8, len) < 0) {
-        perror("write to pty_master failed");
+    pty_queue(u8, len);
+}
+
+static void pty_flush(void) {
+    size_t off = 0;
+    while (off < pty_out.len) {
+        ssize_t n = write(pty_master, pty_out.buf + off, pty_out.len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN)
+                perror("write to pty_master failed");
+            break;
+        }
+        off += n;
+    }
+    if (off == pty_out.len || errno != EAGAIN) {
+        pty_out.len = 0;
+        return;
     }
+    memmove(pty_out.buf, pty_out.buf + off, pty_out.len - off);
+    pty_out.len -= off;
 }
 
-static int text_width(const char *str) {
-    int w = 0;
-    int advance, lsb;
-    for (const char *p = str; *p; p++) {
-        stbtt_GetCodepointHMetrics(&font, *p, &advance, &lsb);
-        w += (int)(advance * font_scale);
+/* Pastes are fed into the PTY queue one chunk at a time, and only once the
+ * previous chunk has been written, so a large paste follows the reader's
+ * pace while input and rendering carry on. Line breaks, LF or CRLF, are
+ * sent as one CR, as for typed text. Inside bracketed paste ESC is dropped, so the text cannot
+ * end the bracket early. */
+#define PASTE_CHUNK 16384
+
+static struct {
+    char *buf;
+    size_t len, off;
+    int bracketed, cr;
+    double t0;
+    size_t last_len;
+    double last_ms;
+    uint64_t total;
+} paste;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int utf8_encode(uint32_t c, unsigned char *out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
     }
-    return w;
+    if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | ((c >> 18) & 0x07);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
 }
 
-static void draw_keyboard(void) {
-    int ascent, descent, linegap;
-    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
-    int font_height = (int)((ascent - descent) * font_scale);
-    int baseline_offset = (font_height / 2) + (int)(ascent * font_scale) - font_height;
+/* The character a keysym types, or 0. Latin-1 keysyms are their own
+ * code points; xkbcommon knows the rest. */
+static uint32_t keysym_unicode(uint32_t ksym) {
+    return ksym < 0x100 ? ksym : xkb_keysym_to_utf32(ksym);
+}
+
+static uint32_t utf8_decode(const unsigned char **p, const unsigned char *end) {
+    const unsigned char *s = *p;
+    uint32_t c = *s++;
+    int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    if (more)
+        c &= 0x3f >> more;
+    while (more-- && s < end)
+        c = (c << 6) | (*s++ & 0x3f);
+    *p = s;
+    return c;
+}
+
+/* Each stored line carries a 128 bit set of the (ASCII case folded) byte
+ * pairs in its text. A search only reads the text of lines whose set covers
+ * every pair of the query, which skips almost all of them. */
+static inline void bloom_add(uint64_t *bloom, unsigned char a, unsigned char b) {
+    if (a >= 'A' && a <= 'Z') a |= 0x20;
+    if (b >= 'A' && b <= 'Z') b |= 0x20;
+    unsigned int bit = (a * 31u + b) & 127;
+    bloom[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+static void text_bloom(uint64_t *bloom, const unsigned char *t, size_t n) {
+    bloom[0] = bloom[1] = 0;
+    for (size_t i = 0; i + 1 < n; i++)
+        bloom_add(bloom, t[i], t[i + 1]);
+}
+
+/* Scrollback lives here rather than in libtsm, which keeps a full cell
+ * struct per column. A line is stored as
+ *
+ *   u16 nspans, u16 text_len, nspans * span, text_len bytes of UTF-8
+ *
+ * where a span is a run of cells sharing colors, flags and width
+ * (u16 count, 3 byte fg, 3 byte bg, u8 flags | width << 6). Trailing blank
+ * cells are dropped. Lines are packed into 64 KiB blocks; once the RAM
+ * budget is used up the oldest blocks move to an unlinked spill file, or are
+ * dropped if there is none. */
+#define SB_BLOCK_SIZE (64 * 1024)
+#define SB_SPAN_SIZE 9
+
+struct sb_block {
+    unsigned char *data;
+    int slot;
+    uint32_t used;
+};
+
+struct sb_line {
+    uint32_t block;
+    uint32_t off;
+    uint64_t bloom[2];
+};
+
+static struct {
+    struct sb_line *lines;
+    size_t line_head, nlines;
+    uint64_t pushed;
+    struct sb_block *blocks;
+    size_t block_head, nblocks, block_cap;
+    uint32_t block_base;
+    size_t ram_blocks, ram_budget;
+    int spill_fd;
+    unsigned char *spill_map;
+    size_t spill_slots, spill_nfree;
+    int *spill_free;
+} sb = {.spill_fd = -1, .ram_budget = 8 << 20};
+
+static struct sb_block *sb_block_at(uint32_t abs) {
+    return &sb.blocks[(sb.block_head + (abs - sb.block_base)) % sb.block_cap];
+}
+
+static const unsigned char *sb_line_data(size_t idx) {
+    const struct sb_line *l = &sb.lines[(sb.line_head + idx) % sb_max];
+    const struct sb_block *b = sb_block_at(l->block);
+    const unsigned char *data = b->data ? b->data : sb.spill_map + (size_t)b->slot * SB_BLOCK_SIZE;
+    return data + l->off;
+}
+
+static struct sb_block *sb_block_push(void) {
+    if (sb.nblocks == sb.block_cap) {
+        size_t cap = sb.block_cap ? sb.block_cap * 2 : 16;
+        struct sb_block *blocks = malloc(cap * sizeof(*blocks));
+        if (!blocks) return NULL;
+        for (size_t i = 0; i < sb.nblocks; i++)
+            blocks[i] = sb.blocks[(sb.block_head + i) % sb.block_cap];
+        free(sb.blocks);
+        sb.blocks = blocks;
+        sb.block_cap = cap;
+        sb.block_head = 0;
+    }
+    unsigned char *data = malloc(SB_BLOCK_SIZE);
+    if (!data) return NULL;
+    struct sb_block *b = &sb.blocks[(sb.block_head + sb.nblocks++) % sb.block_cap];
+    b->data = data;
+    b->slot = -1;
+    b->used = 0;
+    sb.ram_blocks++;
+    return b;
+}
+
+static void sb_block_pop(void) {
+    struct sb_block *b = &sb.blocks[sb.block_head];
+    if (b->data) {
+        free(b->data);
+        sb.ram_blocks--;
+    } else {
+        sb.spill_free[sb.spill_nfree++] = b->slot;
+    }
+    sb.block_head = (sb.block_head + 1) % sb.block_cap;
+    sb.nblocks--;
+    sb.block_base++;
+}
+
+static void sb_line_pop(void) {
+    sb.line_head = (sb.line_head + 1) % sb_max;
+    sb.nlines--;
+    uint32_t keep = sb.nlines ? sb.lines[sb.line_head].block : sb.block_base + sb.nblocks - 1;
+    while (sb.nblocks > 1 && (int32_t)(keep - sb.block_base) > 0)
+        sb_block_pop();
+}
+
+static int sb_spill_grow(void) {
+    size_t slots = sb.spill_slots ? sb.spill_slots * 2 : 16;
+    if (ftruncate(sb.spill_fd, (off_t)slots * SB_BLOCK_SIZE) < 0)
+        return -1;
+    void *map = sb.spill_map
+        ? mremap(sb.spill_map, sb.spill_slots * SB_BLOCK_SIZE, slots * SB_BLOCK_SIZE, MREMAP_MAYMOVE)
+        : mmap(NULL, slots * SB_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sb.spill_fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    sb.spill_map = map;
+    int *free_slots = realloc(sb.spill_free, slots * sizeof(int));
+    if (!free_slots)
+        return -1;
+    sb.spill_free = free_slots;
+    for (size_t i = slots; i > sb.spill_slots; i--)
+        sb.spill_free[sb.spill_nfree++] = i - 1;
+    sb.spill_slots = slots;
+    return 0;
+}
+
+static int sb_spill_oldest(void) {
+    if (sb.spill_fd < 0 || sb.ram_blocks <= 1)
+        return -1;
+    if (!sb.spill_nfree && sb_spill_grow() < 0)
+        return -1;
+    struct sb_block *b = &sb.blocks[(sb.block_head + sb.nblocks - sb.ram_blocks) % sb.block_cap];
+    b->slot = sb.spill_free[--sb.spill_nfree];
+    memcpy(sb.spill_map + (size_t)b->slot * SB_BLOCK_SIZE, b->data, b->used);
+    free(b->data);
+    b->data = NULL;
+    sb.ram_blocks--;
+    return 0;
+}
+
+static void sb_enforce_budget(void) {
+    while (sb.ram_blocks > 1 && sb.ram_blocks * SB_BLOCK_SIZE > sb.ram_budget) {
+        if (sb_spill_oldest() == 0)
+            continue;
+        uint32_t base = sb.block_base;
+        while (sb.nlines && sb.block_base == base)
+            sb_line_pop();
+        if (sb.block_base == base)
+            break;
+    }
+}
+
+static inline int cell_same_span(const struct cell *a, const struct cell *b) {
+    return a->fg == b->fg && a->bg == b->bg && a->flags == b->flags && a->width == b->width;
+}
+
+static void sb_push(const struct cell *cells, int n) {
+    if (sb_max <= 0) return;
+    while (n > 0 && (cells[n - 1].ch == 0 || cells[n - 1].ch == ' ') &&
+           cells[n - 1].bg == 0xff000000 && !cells[n - 1].flags)
+        n--;
+
+    if (sb.nlines == (size_t)sb_max)
+        sb_line_pop();
+
+    size_t worst = 4 + (size_t)n * (SB_SPAN_SIZE + 4);
+    struct sb_block *b = sb.nblocks ? sb_block_at(sb.block_base + sb.nblocks - 1) : NULL;
+    if (!b || !b->data || b->used + worst > SB_BLOCK_SIZE)
+        b = sb_block_push();
+    if (!b) return;
+
+    int nspans = 0;
+    for (int x = 0; x < n; x++) {
+        if (!cells[x].width) continue;
+        if (!nspans || !cell_same_span(&cells[x], &cells[x - 1]))
+            nspans++;
+    }
+
+    unsigned char *out = b->data + b->used;
+    unsigned char *sp = out + 4, *text = sp + nspans * SB_SPAN_SIZE, *t = text;
+    unsigned char *span = NULL;
+    const struct cell *prev = NULL;
+    for (int x = 0; x < n; x++) {
+        const struct cell *c = &cells[x];
+        if (!c->width) continue;
+        if (!prev || !cell_same_span(c, prev)) {
+            span = sp;
+            sp += SB_SPAN_SIZE;
+            span[0] = span[1] = 0;
+            span[2] = c->fg >> 16; span[3] = c->fg >> 8; span[4] = c->fg;
+            span[5] = c->bg >> 16; span[6] = c->bg >> 8; span[7] = c->bg;
+            span[8] = c->flags | (c->width << 6);
+        }
+        uint16_t count = (span[0] | span[1] << 8) + 1;
+        span[0] = count;
+        span[1] = count >> 8;
+        t += utf8_encode(c->ch ? c->ch : ' ', t);
+        prev = c;
+    }
+    size_t text_len = t - text;
+    out[0] = nspans;
+    out[1] = nspans >> 8;
+    out[2] = text_len;
+    out[3] = text_len >> 8;
+
+    struct sb_line *l = &sb.lines[(sb.line_head + sb.nlines++) % sb_max];
+    l->block = sb.block_base + sb.nblocks - 1;
+    l->off = b->used;
+    text_bloom(l->bloom, text, text_len);
+    b->used += t - out;
+    sb.pushed++;
+    sb_enforce_budget();
+}
+
+static void sb_decode(size_t idx, struct cell *out, int cols) {
+    const unsigned char *p = sb_line_data(idx);
+    int nspans = p[0] | p[1] << 8, text_len = p[2] | p[3] << 8;
+    const unsigned char *span = p + 4, *t = span + nspans * SB_SPAN_SIZE, *end = t + text_len;
+    int x = 0;
+    for (int s = 0; s < nspans; s++, span += SB_SPAN_SIZE) {
+        struct cell c = {
+            .fg = 0xff000000 | span[2] << 16 | span[3] << 8 | span[4],
+            .bg = 0xff000000 | span[5] << 16 | span[6] << 8 | span[7],
+            .width = span[8] >> 6,
+            .flags = span[8] & 0x3f};
+        for (int count = span[0] | span[1] << 8; count > 0 && t < end; count--) {
+            c.ch = utf8_decode(&t, end);
+            if (x < cols) out[x] = c;
+            x++;
+            for (int w = 1; w < c.width; w++, x++)
+                if (x < cols) out[x] = (struct cell){0, c.fg, c.bg, 0, c.flags};
+        }
+    }
+    for (; x < cols; x++)
+        out[x] = (struct cell){0, 0xffffffff, 0xff000000, 1, 0};
+}
+
+static int sb_init(const char *spill_dir) {
+    if (sb_max <= 0) return 0;
+    sb.lines = calloc(sb_max, sizeof(*sb.lines));
+    if (!sb.lines) return -1;
+    if (spill_dir) {
+        sb.spill_fd = open(spill_dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+        if (sb.spill_fd < 0)
+            perror("touchvt: scrollback spill");
+    }
+    return 0;
+}
+
+static void sb_free(void) {
+    while (sb.nblocks)
+        sb_block_pop();
+    free(sb.blocks);
+    free(sb.lines);
+    free(sb.spill_free);
+    if (sb.spill_map)
+        munmap(sb.spill_map, sb.spill_slots * SB_BLOCK_SIZE);
+    if (sb.spill_fd >= 0)
+        close(sb.spill_fd);
+}
+
+#define SEARCH_MAX 128
+#define SEARCH_MARKS 16
+
+enum { MARK_MATCH, MARK_CURRENT, MARK_SELECTION };
+
+struct mark {
+    int c0, c1;
+    int kind;
+};
+
+/* Lines are addressed by one number across scrollback and screen: stored
+ * line i is pushed - nlines + i and screen row r is pushed + r, so a line
+ * keeps its number when it scrolls off into the store. */
+static struct {
+    int active, regex, found;
+    char query[SEARCH_MAX];
+    int len;
+    regex_t re;
+    int re_ok;
+    uint64_t bloom[2];
+    uint64_t line;
+    int so, eo;
+    double last_ms;
+    size_t last_lines;
+} search;
+
+static const char *line_text(uint64_t line, int *len) {
+    if (line >= sb.pushed) {
+        const struct cell *c = screen_cells + (line - sb.pushed) * term_cols;
+        unsigned char *t = (unsigned char *)row_text;
+        for (int x = 0; x < term_cols; x++)
+            if (c[x].width)
+                t += utf8_encode(c[x].ch ? c[x].ch : ' ', t);
+        *len = t - (unsigned char *)row_text;
+        return row_text;
+    }
+    const unsigned char *p = sb_line_data(line - (sb.pushed - sb.nlines));
+    *len = p[2] | p[3] << 8;
+    return (const char *)p + 4 + (p[0] | p[1] << 8) * SB_SPAN_SIZE;
+}
+
+static int line_may_match(uint64_t line) {
+    if (line >= sb.pushed) return 1;
+    const struct sb_line *l = &sb.lines[(sb.line_head + line - (sb.pushed - sb.nlines)) % sb_max];
+    return (l->bloom[0] & search.bloom[0]) == search.bloom[0] &&
+           (l->bloom[1] & search.bloom[1]) == search.bloom[1];
+}
+
+/* Finds the first non-empty match starting at or after byte from. */
+static int search_match(const char *t, int len, int from, int *so, int *eo) {
+    if (!search.len) return 0;
+    while (from < len) {
+        if (search.regex) {
+            if (!search.re_ok) return 0;
+            regmatch_t m = {.rm_so = from, .rm_eo = len};
+            if (regexec(&search.re, t, 1, &m, REG_STARTEND | (from ? REG_NOTBOL : 0)))
+                return 0;
+            *so = m.rm_so;
+            *eo = m.rm_eo;
+        } else {
+            const char *hit = memmem(t + from, len - from, search.query, search.len);
+            if (!hit) return 0;
+            *so = hit - t;
+            *eo = *so + search.len;
+        }
+        if (*eo > *so) return 1;
+        from = *so + 1;
+    }
+    return 0;
+}
+
+/* The longest run of plain characters every match of re must contain, used
+ * to prefilter lines. Bracket expressions and quantifier bounds are skipped
+ * whole; alternation and groups give up on it. */
+static int regex_literal(const char *re, char *out) {
+    int best = 0, n = 0;
+    char run[SEARCH_MAX];
+    if (strpbrk(re, "|()"))
+        return 0;
+    for (const char *p = re;; p++) {
+        int plain = *p && !strchr(".[]^$*+?{}\\", *p);
+        int optional = p[1] == '*' || p[1] == '?' || p[1] == '{';
+        if (plain && !optional) {
+            run[n++] = *p;
+            if (p[1] != '+') continue;
+        }
+        if (n > best) {
+            memcpy(out, run, n);
+            best = n;
+        }
+        n = 0;
+        if (!*p) break;
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '{') {
+            while (p[1] && p[1] != '}') p++;
+        } else if (*p == '[') {
+            if (p[1] == '^') p++;
+            if (p[1] == ']') p++;
+            while (p[1] && p[1] != ']') {
+                p++;
+                if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+                    char end = p[1];
+                    for (p += 2; *p && !(p[0] == end && p[1] == ']'); p++)
+                        ;
+                    if (!*p) {
+                        p--;
+                        break;
+                    }
+                    p++;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+static void search_compile(void) {
+    char lit[SEARCH_MAX];
+    int lit_len = search.len;
+    search.query[search.len] = 0;
+    if (search.re_ok)
+        regfree(&search.re);
+    search.re_ok = 0;
+    memcpy(lit, search.query, search.len);
+    if (search.regex) {
+        search.re_ok = search.len && !regcomp(&search.re, search.query, REG_EXTENDED);
+        lit_len = regex_literal(search.query, lit);
+    }
+    text_bloom(search.bloom, (const unsigned char *)lit, lit_len);
+}
+
+/* Moves to the closest match before (dir < 0) or after (dir > 0) byte pos of
+ * line. */
+static int search_find(uint64_t line, int pos, int dir) {
+    uint64_t first = sb.pushed - sb.nlines, end = sb.pushed + term_rows;
+    size_t scanned = 0;
+    for (uint64_t l = line; l >= first && l < end; l += dir) {
+        scanned++;
+        if (!line_may_match(l)) continue;
+        int len, so, eo, from = 0, hit = 0;
+        const char *t = line_text(l, &len);
+        while (search_match(t, len, from, &so, &eo)) {
+            from = eo;
+            if (l == line && (dir < 0 ? so >= pos : so <= pos)) {
+                if (dir < 0) break;
+                continue;
+            }
+            hit = 1;
+            search.so = so;
+            search.eo = eo;
+            if (dir > 0) break;
+        }
+        if (hit) {
+            search.line = l;
+            search.last_lines = scanned;
+            return 1;
+        }
+    }
+    search.last_lines = scanned;
+    return 0;
+}
+
+/* Column ranges of the matches on view row v. */
+static int row_marks(int v, const struct cell *cells, struct mark *m) {
+    uint64_t line = sb.pushed - sb_count + v;
+    if (!search.active || !search.len || v >= term_rows - 1 ||
+        v - sb_count < -(int)sb.nlines || !line_may_match(line))
+        return 0;
+
+    int len, so, eo, from = 0, n = 0;
+    int bso[SEARCH_MARKS], beo[SEARCH_MARKS];
+    const char *t = line_text(line, &len);
+    while (n < SEARCH_MARKS && search_match(t, len, from, &so, &eo)) {
+        bso[n] = so;
+        beo[n] = eo;
+        m[n].c0 = m[n].c1 = -1;
+        m[n].kind = search.found && line == search.line && so == search.so ? MARK_CURRENT : MARK_MATCH;
+        n++;
+        from = eo;
+    }
+    if (!n) return 0;
+
+    unsigned char tmp[4];
+    for (int x = 0, b = 0; x < term_cols; x++) {
+        if (!cells[x].width) continue;
+        int l = utf8_encode(cells[x].ch ? cells[x].ch : ' ', tmp);
+        for (int i = 0; i < n; i++) {
+            if (bso[i] >= b && bso[i] < b + l) m[i].c0 = x;
+            if (beo[i] > b && beo[i] <= b + l) m[i].c1 = x + cells[x].width;
+        }
+        b += l;
+    }
+    return n;
+}
+
+/* Selection endpoints use the same line numbers as search, so a selection
+ * stays on its text while output scrolls. The end cell is inclusive. */
+static struct {
+    int active, pending, dragging;
+    uint64_t l0, l1;
+    int c0, c1;
+    int x, y;
+} sel;
+
+static struct {
+    char *buf;
+    size_t len, cap;
+} clip;
+
+static void sel_bounds(uint64_t *l0, int *c0, uint64_t *l1, int *c1) {
+    int fwd = sel.l0 < sel.l1 || (sel.l0 == sel.l1 && sel.c0 <= sel.c1);
+    *l0 = fwd ? sel.l0 : sel.l1;
+    *c0 = fwd ? sel.c0 : sel.c1;
+    *l1 = fwd ? sel.l1 : sel.l0;
+    *c1 = fwd ? sel.c1 : sel.c0;
+}
+
+/* Selected columns [*a, *b) of view row v. */
+static int sel_span(int v, int *a, int *b) {
+    if (!sel.active) return 0;
+    uint64_t line = sb.pushed - sb_count + v, l0, l1;
+    int c0, c1;
+    sel_bounds(&l0, &c0, &l1, &c1);
+    if (v - sb_count < -(int)sb.nlines || line < l0 || line > l1) return 0;
+    *a = line == l0 ? c0 : 0;
+    *b = line == l1 ? c1 + 1 : term_cols;
+    return 1;
+}
+
+static const struct cell *line_cells(uint64_t line) {
+    if (line >= sb.pushed)
+        return screen_cells + (line - sb.pushed) * term_cols;
+    sb_decode(line - (sb.pushed - sb.nlines), row_buf, term_cols);
+    return row_buf;
+}
+
+/* Copies the selection as UTF-8 into the clipboard. The buffer is sized for
+ * the worst case once, then filled in a single pass over the cells. */
+static void sel_copy(void) {
+    uint64_t l0, l1, first = sb.pushed - sb.nlines;
+    int c0, c1;
+    sel_bounds(&l0, &c0, &l1, &c1);
+    if (l0 < first) {
+        l0 = first;
+        c0 = 0;
+    }
+    if (l1 < l0) return;
+
+    size_t need = (l1 - l0 + 1) * ((size_t)term_cols * 4 + 1);
+    if (need > clip.cap) {
+        char *buf = realloc(clip.buf, need);
+        if (!buf) {
+            fprintf(stderr, "touchvt: copy: out of memory\n");
+            return;
+        }
+        clip.buf = buf;
+        clip.cap = need;
+    }
+
+    unsigned char *out = (unsigned char *)clip.buf;
+    for (uint64_t line = l0; line <= l1; line++) {
+        const struct cell *c = line_cells(line);
+        int a = line == l0 ? c0 : 0, b = line == l1 ? c1 + 1 : term_cols;
+        unsigned char *start = out;
+        for (int x = a; x < b && x < term_cols; x++)
+            if (c[x].width)
+                out += utf8_encode(c[x].ch ? c[x].ch : ' ', out);
+        while (out > start && out[-1] == ' ')
+            out--;
+        if (line != l1)
+            *out++ = '\n';
+    }
+    clip.len = out - (unsigned char *)clip.buf;
+}
+
+static int snap_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
+                   size_t len, unsigned int width, unsigned int posx,
+                   unsigned int posy, const struct tsm_screen_attr *attr,
+                   tsm_age_t age, void *data) {
+    (void)con; (void)id; (void)age; (void)data;
+
+    if ((int)posx >= term_cols || (int)posy >= term_rows)
+        return 0;
+
+    uint32_t fg = 0xff000000 | (attr->fr << 16) | (attr->fg << 8) | attr->fb;
+    uint32_t bg = 0xff000000 | (attr->br << 16) | (attr->bg << 8) | attr->bb;
+
+    if (attr->inverse) {
+        uint32_t tmp = fg;
+        fg = bg;
+        bg = tmp;
+    }
+
+    struct cell *c = &screen_next[posy * term_cols + posx];
+    c->ch = (len > 0) ? ch[0] : 0;
+    c->fg = fg;
+    c->bg = bg;
+    c->width = width;
+    c->flags = (attr->bold ? CELL_BOLD : 0) | (attr->underline ? CELL_UNDERLINE : 0) |
+               (attr->blink ? CELL_BLINK : 0);
+    return 0;
+}
+
+static uint64_t memhash(const void *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ ((const unsigned char *)p)[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t cells_hash(const struct cell *c, int n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ c[i].ch) * 0x100000001b3ULL;
+        h = (h ^ c[i].fg) * 0x100000001b3ULL;
+        h = (h ^ (c[i].bg | (uint64_t)c[i].width << 32 | (uint64_t)c[i].flags << 40)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void screen_alloc(void) {
+    size_t n = (size_t)term_cols * term_rows;
+    free(screen_cells);
+    free(screen_next);
+    free(row_buf);
+    free(row_text);
+    free(row_hash);
+    free(row_hash_next);
+    free(drawn_id);
+    screen_cells = calloc(n, sizeof(struct cell));
+    screen_next = calloc(n, sizeof(struct cell));
+    row_buf = calloc(term_cols, sizeof(struct cell));
+    row_text = malloc((size_t)term_cols * 4);
+    row_hash = calloc(term_rows, sizeof(uint64_t));
+    row_hash_next = calloc(term_rows, sizeof(uint64_t));
+    drawn_id = calloc(term_rows, sizeof(uint64_t));
+    if (!screen_cells || !screen_next || !row_buf || !row_text || !row_hash || !row_hash_next || !drawn_id) {
+        fprintf(stderr, "touchvt: out of memory\n");
+        exit(1);
+    }
+    drawn_valid = 0;
+}
+
+static void screen_snapshot(void) {
+    tsm_screen_draw(tsm_screen, snap_cb, NULL);
+    for (int r = 0; r < term_rows; r++)
+        row_hash_next[r] = cells_hash(screen_next + r * term_cols, term_cols);
+}
+
+static void screen_commit(void) {
+    struct cell *c = screen_cells;
+    screen_cells = screen_next;
+    screen_next = c;
+    uint64_t *h = row_hash;
+    row_hash = row_hash_next;
+    row_hash_next = h;
+}
+
+/* Finds how many lines scrolled off the top while the last chunk was parsed
+ * and moves them into the scrollback. Rows above the old cursor position are
+ * settled output, so a scroll by k shows up as old rows [k, cy) reappearing
+ * at the top of the new screen, and at least one of them has to. est is the
+ * line feed count of the chunk minus the cursor's own movement, too high if
+ * the cursor went back up afterwards; of the shifts that match, the one
+ * nearest to it wins, which keeps runs of identical lines from being
+ * mistaken for no scroll at all. max is the most the chunk could have
+ * scrolled. Redraws in place match no k above 0 and push nothing. */
+static int screen_harvest(int est, int max, int old_cy, int was_alt) {
+    int k = 0;
+    if (!was_alt && !(tsm_screen_get_flags(tsm_screen) & TSM_SCREEN_ALTERNATE)) {
+        int hi = max < old_cy - 1 ? max : old_cy - 1;
+        for (int c = 0, best = -1; c <= hi; c++) {
+            int r = c;
+            while (r < old_cy && row_hash[r] == row_hash_next[r - c])
+                r++;
+            if (r == old_cy && (best < 0 || abs(c - est) < best)) {
+                k = c;
+                best = abs(c - est);
+            }
+        }
+        for (int r = 0; r < k; r++)
+            sb_push(screen_cells + r * term_cols, term_cols);
+    }
+    screen_commit();
+    return k;
+}
+
+/* Local echo prediction: printable keys are drawn underlined at the cursor
+ * as soon as they are sent, and dropped again once the same character shows
+ * up on the screen. If the application's cursor moves past a prediction
+ * without echoing it, or nothing comes back in time, prediction stops until
+ * the next Enter. Predictions are always tracked, but in auto mode only
+ * shown once the echo delay they measure is long enough to notice. */
+#define PRED_MAX 64
+#define PRED_TIMEOUT_MS 1000
+#define PRED_SHOW_MS 30
+
+enum { PRED_NEVER, PRED_AUTO, PRED_ALWAYS };
+
+static struct {
+    int mode;
+    int n;
+    struct {
+        uint32_t ch;
+        int x, y;
+        double t;
+    } cell[PRED_MAX];
+    int suspended;
+    double srtt;
+    unsigned long confirmed, failed;
+} pred = {.mode = PRED_AUTO};
+
+static int pred_shown(void) {
+    return pred.n && !sb_count &&
+           (pred.mode == PRED_ALWAYS || (pred.mode == PRED_AUTO && pred.srtt > PRED_SHOW_MS));
+}
+
+static void pred_fail(void) {
+    pred.n = 0;
+    pred.suspended = 1;
+    pred.failed++;
+}
+
+static void pred_key(uint32_t ksym, int plain) {
+    if (pred.mode == PRED_NEVER) return;
+    if (ksym == 0xff0d) {
+        pred.n = 0;
+        pred.suspended = 0;
+        return;
+    }
+
+    struct termios tio;
+    if ((tsm_screen_get_flags(tsm_screen) & TSM_SCREEN_ALTERNATE) ||
+        (tcgetattr(pty_master, &tio) == 0 && (tio.c_lflag & ICANON) && !(tio.c_lflag & ECHO))) {
+        pred.n = 0;
+        return;
+    }
+    if (pred.suspended) return;
+
+    if (ksym == 0x007f && plain) {
+        if (pred.n) pred.n--;
+        return;
+    }
+    if (!plain || ksym < 0x20 || ksym >= 0x100 || pred.n == PRED_MAX) {
+        pred.n = 0;
+        return;
+    }
+
+    int x = pred.n ? pred.cell[pred.n - 1].x + 1 : (int)tsm_screen_get_cursor_x(tsm_screen);
+    int y = pred.n ? pred.cell[pred.n - 1].y : (int)tsm_screen_get_cursor_y(tsm_screen);
+    if (x >= term_cols - 1) return;
+    pred.cell[pred.n].ch = ksym;
+    pred.cell[pred.n].x = x;
+    pred.cell[pred.n].y = y;
+    pred.cell[pred.n].t = now_ms();
+    pred.n++;
+}
+
+/* Checks the predictions against the screen after PTY output. */
+static void pred_check(void) {
+    int cx = tsm_screen_get_cursor_x(tsm_screen), cy = tsm_screen_get_cursor_y(tsm_screen);
+    double now = now_ms();
+    int keep = 0;
+    for (int i = 0; i < pred.n; i++) {
+        int x = pred.cell[i].x, y = pred.cell[i].y;
+        if (y < 0) continue;
+        if (screen_cells[y * term_cols + x].ch == pred.cell[i].ch) {
+            double rtt = now - pred.cell[i].t;
+            pred.srtt = pred.srtt ? pred.srtt * 0.875 + rtt * 0.125 : rtt;
+            pred.confirmed++;
+            continue;
+        }
+        if (cy > y || (cy == y && cx > x) || now - pred.cell[i].t > PRED_TIMEOUT_MS) {
+            pred_fail();
+            return;
+        }
+        pred.cell[keep++] = pred.cell[i];
+    }
+    pred.n = keep;
+}
+
+/* Milliseconds until the oldest prediction times out, or -1. */
+static int pred_timeout(void) {
+    if (!pred.n) return -1;
+    int ms = (int)(pred.cell[0].t + PRED_TIMEOUT_MS - now_ms()) + 1;
+    return ms > 0 ? ms : 0;
+}
+
+static void cursor_get(int *x, int *y) {
+    if (pred_shown()) {
+        *x = pred.cell[pred.n - 1].x + 1;
+        *y = pred.cell[pred.n - 1].y;
+        return;
+    }
+    *x = tsm_screen_get_cursor_x(tsm_screen);
+    *y = tsm_screen_get_cursor_y(tsm_screen);
+}
+
+static void view_follow(int lines) {
+    if (!lines) return;
+    for (int i = 0; i < pred.n; i++)
+        pred.cell[i].y -= lines;
+    if (sb_count) {
+        sb_count += lines;
+        if ((size_t)sb_count > sb.nlines) sb_count = sb.nlines;
+    } else {
+        out_shift += lines;
+    }
+}
+
+/* libtsm parses DEC private modes but keeps the ones it does not implement
+ * to itself, so the PTY output is scanned for the handful of modes that
+ * change how touch and keyboard input are sent. */
+#define MODE_MOUSE_X10 0x01
+#define MODE_MOUSE_CLICK 0x02
+#define MODE_MOUSE_DRAG 0x04
+#define MODE_MOUSE_MOTION 0x08
+#define MODE_MOUSE_SGR 0x10
+#define MODE_BRACKETED_PASTE 0x20
+#define MODE_SYNC 0x40
+#define MODE_MOUSE_ANY (MODE_MOUSE_X10 | MODE_MOUSE_CLICK | MODE_MOUSE_DRAG | MODE_MOUSE_MOTION)
+
+static const struct {
+    int mode;
+    uint32_t bit;
+} dec_modes[] = {
+    {9, MODE_MOUSE_X10},
+    {1000, MODE_MOUSE_CLICK},
+    {1002, MODE_MOUSE_DRAG},
+    {1003, MODE_MOUSE_MOTION},
+    {1006, MODE_MOUSE_SGR},
+    {2004, MODE_BRACKETED_PASTE},
+    {2026, MODE_SYNC},
+};
+
+static uint32_t term_modes;
+
+/* While the application holds synchronized output (mode 2026) the terminal
+ * area is not presented, so only the finished frame is drawn. An update
+ * that is never closed is ended after SYNC_TIMEOUT_MS. */
+#define SYNC_TIMEOUT_MS 150
+
+static struct {
+    double since;
+    unsigned long updates, deferred, timeouts;
+} sync_out;
+
+enum { SCAN_GROUND, SCAN_ESC, SCAN_CSI, SCAN_STR, SCAN_OSC, SCAN_OSC52_SEL, SCAN_OSC52_DATA };
+
+static struct {
+    int state, priv, nparams;
+    int params[16];
+    int scrolls;
+} scan;
+
+static void scan_csi_final(unsigned char c) {
+    if (c == 'S' && !scan.priv)
+        scan.scrolls += scan.nparams && scan.params[0] ? scan.params[0] : 1;
+    if (!scan.priv || (c != 'h' && c != 'l')) return;
+    for (int i = 0; i < scan.nparams; i++) {
+        for (size_t m = 0; m < sizeof(dec_modes) / sizeof(dec_modes[0]); m++) {
+            if (dec_modes[m].mode != scan.params[i]) continue;
+            if (c == 'h' && dec_modes[m].bit == MODE_SYNC && !(term_modes & MODE_SYNC)) {
+                sync_out.since = now_ms();
+                sync_out.updates++;
+            }
+            if (c == 'h')
+                term_modes |= dec_modes[m].bit;
+            else
+                term_modes &= ~dec_modes[m].bit;
+        }
+    }
+}
+
+/* OSC 52 sets (or with "?" queries) the clipboard. The base64 payload is
+ * decoded as it streams in with the rest of the output, into a buffer that
+ * may not grow past osc52_max; a longer payload is dropped whole. Reading
+ * the clipboard back is only answered with --osc52 rw. */
+enum { OSC52_OFF, OSC52_WRITE, OSC52_RW };
+
+static int osc52_mode = OSC52_WRITE;
+static size_t osc52_max = 1 << 20;
+static struct {
+    char *buf;
+    size_t len, cap;
+    uint32_t acc;
+    int bits, query, bad;
+} osc52;
+
+static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int b64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static void osc52_begin(void) {
+    osc52.len = 0;
+    osc52.acc = 0;
+    osc52.bits = osc52.query = osc52.bad = 0;
+}
+
+static void osc52_byte(unsigned char c) {
+    if (osc52.bad || c == '=') return;
+    if (c == '?' && !osc52.len && !osc52.bits) {
+        osc52.query = 1;
+        return;
+    }
+    int v = b64_value(c);
+    if (v < 0 || osc52.query) {
+        osc52.bad = 1;
+        return;
+    }
+    osc52.acc = osc52.acc << 6 | v;
+    osc52.bits += 6;
+    if (osc52.bits < 8) return;
+    osc52.bits -= 8;
+
+    if (osc52.len == osc52.cap) {
+        size_t cap = osc52.cap ? osc52.cap * 2 : 4096;
+        if (cap > osc52_max) cap = osc52_max;
+        char *buf = cap > osc52.cap ? realloc(osc52.buf, cap) : NULL;
+        if (!buf) {
+            osc52.bad = 1;
+            return;
+        }
+        osc52.buf = buf;
+        osc52.cap = cap;
+    }
+    osc52.buf[osc52.len++] = osc52.acc >> osc52.bits;
+}
+
+static void osc52_reply(void) {
+    char out[1024];
+    size_t n = 0;
+    pty_queue("\033]52;c;", 7);
+    for (size_t i = 0; i < clip.len; i += 3) {
+        const unsigned char *p = (const unsigned char *)clip.buf + i;
+        size_t left = clip.len - i;
+        uint32_t v = p[0] << 16 | (left > 1 ? p[1] << 8 : 0) | (left > 2 ? p[2] : 0);
+        out[n++] = b64_chars[v >> 18 & 63];
+        out[n++] = b64_chars[v >> 12 & 63];
+        out[n++] = left > 1 ? b64_chars[v >> 6 & 63] : '=';
+        out[n++] = left > 2 ? b64_chars[v & 63] : '=';
+        if (n > sizeof(out) - 4) {
+            pty_queue(out, n);
+            n = 0;
+        }
+    }
+    pty_queue(out, n);
+    pty_queue("\a", 1);
+}
+
+/* The decoded buffer becomes the clipboard, and the old clipboard buffer
+ * is kept for the next payload. */
+static void osc52_end(void) {
+    if (osc52.query) {
+        if (osc52_mode == OSC52_RW)
+            osc52_reply();
+        return;
+    }
+    if (osc52.bad) return;
+    char *buf = clip.buf;
+    size_t cap = clip.cap;
+    clip.buf = osc52.buf;
+    clip.cap = osc52.cap;
+    clip.len = osc52.len;
+    osc52.buf = buf;
+    osc52.cap = cap;
+}
+
+static void term_scan(const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+    while (p < end) {
+        if (scan.state == SCAN_GROUND) {
+            p = memchr(p, 0x1b, end - p);
+            if (!p) return;
+            p++;
+            scan.state = SCAN_ESC;
+            continue;
+        }
+        unsigned char c = *p++;
+        switch (scan.state) {
+        case SCAN_ESC:
+            if (c == '[') {
+                scan.state = SCAN_CSI;
+                scan.priv = 0;
+                scan.nparams = 0;
+                break;
+            }
+            if (c == ']') {
+                scan.state = SCAN_OSC;
+                scan.params[0] = 0;
+                break;
+            }
+            if (c == 'P' || c == '_' || c == '^' || c == 'X') {
+                scan.state = SCAN_STR;
+                break;
+            }
+            if (c == 'c')
+                term_modes = 0;
+            if (c == 'D' || c == 'E')
+                scan.scrolls++;
+            scan.state = c == 0x1b ? SCAN_ESC : SCAN_GROUND;
+            break;
+        case SCAN_CSI:
+            if (c == '?' && !scan.nparams) {
+                scan.priv = 1;
+            } else if (c >= '0' && c <= '9') {
+                if (!scan.nparams) scan.params[scan.nparams++] = 0;
+                int *v = &scan.params[scan.nparams - 1];
+                if (*v < 100000) *v = *v * 10 + (c - '0');
+            } else if (c == ';') {
+                if (!scan.nparams) scan.params[scan.nparams++] = 0;
+                if (scan.nparams < 16) scan.params[scan.nparams++] = 0;
+            } else if (c >= 0x40 && c <= 0x7e) {
+                scan_csi_final(c);
+                scan.state = SCAN_GROUND;
+            } else if (c == 0x1b) {
+                scan.state = SCAN_ESC;
+            } else if (c == 0x18 || c == 0x1a) {
+                scan.state = SCAN_GROUND;
+            }
+            break;
+        case SCAN_OSC:
+            if (c >= '0' && c <= '9') {
+                if (scan.params[0] < 100000) scan.params[0] = scan.params[0] * 10 + (c - '0');
+            } else if (c == ';') {
+                scan.state = scan.params[0] == 52 && osc52_mode != OSC52_OFF ? SCAN_OSC52_SEL : SCAN_STR;
+            } else if (c == 0x07 || c == 0x18 || c == 0x1a) {
+                scan.state = SCAN_GROUND;
+            } else {
+                scan.state = c == 0x1b ? SCAN_ESC : SCAN_STR;
+            }
+            break;
+        case SCAN_OSC52_SEL:
+            if (c == ';') {
+                osc52_begin();
+                scan.state = SCAN_OSC52_DATA;
+            } else if (c == 0x07 || c == 0x18 || c == 0x1a) {
+                scan.state = SCAN_GROUND;
+            } else if (c == 0x1b) {
+                scan.state = SCAN_ESC;
+            }
+            break;
+        case SCAN_OSC52_DATA:
+            if (c == 0x07 || c == 0x1b) {
+                osc52_end();
+                scan.state = c == 0x1b ? SCAN_ESC : SCAN_GROUND;
+            } else if (c == 0x18 || c == 0x1a) {
+                scan.state = SCAN_GROUND;
+            } else {
+                osc52_byte(c);
+            }
+            break;
+        case SCAN_STR:
+            if (c == 0x07 || c == 0x18 || c == 0x1a)
+                scan.state = SCAN_GROUND;
+            else if (c == 0x1b)
+                scan.state = SCAN_ESC;
+            break;
+        }
+    }
+}
+
+/* Milliseconds until a synchronized update times out, or -1. */
+static int sync_timeout(void) {
+    if (!(term_modes & MODE_SYNC)) return -1;
+    int ms = (int)(sync_out.since + SYNC_TIMEOUT_MS - now_ms()) + 1;
+    return ms > 0 ? ms : 0;
+}
+
+/* Feeds PTY output to libtsm in chunks that can scroll at most half a screen
+ * each, so screen_harvest() always sees every line that leaves the top. */
+static void term_input(const char *buf, size_t len) {
+    int max_lf = term_rows / 2 > 0 ? term_rows / 2 : 1;
+    size_t max_bytes = (size_t)max_lf * term_cols;
+
+    while (len) {
+        int was_alt = tsm_screen_get_flags(tsm_screen) & TSM_SCREEN_ALTERNATE;
+        size_t n = 0;
+        int lfs = 0;
+        if (was_alt || sb_max <= 0) {
+            n = len;
+        } else {
+            while (n < len && n < max_bytes && lfs < max_lf) {
+                char c = buf[n++];
+                if (c == '\n' || c == '\v' || c == '\f') lfs++;
+            }
+        }
+        int old_cy = tsm_screen_get_cursor_y(tsm_screen);
+        scan.scrolls = 0;
+        term_scan(buf, n);
+        tsm_vte_input(tsm_vte, buf, n);
+        screen_snapshot();
+        int moved = (int)tsm_screen_get_cursor_y(tsm_screen) - old_cy;
+        int wraps = ((int)n + term_cols - 1) / term_cols;
+        view_follow(screen_harvest(lfs - moved, lfs + scan.scrolls + wraps, old_cy, was_alt));
+        buf += n;
+        len -= n;
+    }
+    if (pred.n)
+        pred_check();
+}
+
+static int text_width_n(const char *str, size_t n) {
+    int w = 0;
+    int advance, lsb;
+    const unsigned char *p = (const unsigned char *)str, *end = p + n;
+    while (p < end) {
+        stbtt_GetCodepointHMetrics(&font, utf8_decode(&p, end), &advance, &lsb);
+        w += (int)(advance * font_scale);
+    }
+    return w;
+}
+
+static int text_width(const char *str) {
+    return text_width_n(str, strlen(str));
+}
+
+/* Draws n bytes of UTF-8 centered in a w by kh box at (x, y). */
+static void draw_label(const char *txt, size_t n, int tw, int x, int y, int w) {
+    int ascent, descent, linegap;
+    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
+    int font_height = (int)((ascent - descent) * font_scale);
+    int baseline_offset = (font_height / 2) + (int)(ascent * font_scale) - font_height;
+
+    int tx = x + (w - tw) / 2;
+    int ty = y + kh / 2;
+    int baseline = ty + baseline_offset;
+    uint32_t c = 0xffffffff;
+
+    int x_cursor = tx;
+    const unsigned char *p = (const unsigned char *)txt, *end = p + n;
+    while (p < end) {
+        uint32_t ch = utf8_decode(&p, end);
+        int gw, gh, xoff, yoff;
+        unsigned char *bmp = stbtt_GetCodepointBitmap(&font, font_scale, font_scale,
+                                                      ch, &gw, &gh, &xoff, &yoff);
+        if (bmp) {
+            draw_bitmap(x_cursor + xoff, baseline + yoff, bmp, gw, gh, c);
+            stbtt_FreeBitmap(bmp, NULL);
+        }
+        int advance, lsb;
+        stbtt_GetCodepointHMetrics(&font, ch, &advance, &lsb);
+        x_cursor += (int)(advance * font_scale);
+    }
+}
+
+/* Draws a key in a keyboard whose top edge is at y0. */
+static void draw_key_face(const struct key_info *ki, int y0, int shift, uint32_t bg) {
+    int ky = y0 + ki->row * kh;
+    fill_rect(ki->x + 1, ky + 1, ki->w - 2, kh - 2, bg);
+    const char *txt = shift ? ki->label_shift : ki->label;
+    draw_label(txt, strlen(txt), shift ? ki->label_shift_w : ki->label_w, ki->x, ky, ki->w);
+}
+
+/* Renders a layer with no key down into its image. */
+static void kb_render(struct kb_layer *ly, int shift) {
+    int h = kb_rows * kh;
+    uint8_t *img = malloc((size_t)h * fb_stride);
+    if (!img) {
+        fprintf(stderr, "touchvt: out of memory\n");
+        exit(1);
+    }
+    uint8_t *saved_draw = fb_draw;
+    int saved_y0 = clip_y0, saved_y1 = clip_y1;
+    int saved_d0 = dirty_y0, saved_d1 = dirty_y1;
+    fb_draw = img;
+    clip_y0 = 0;
+    clip_y1 = h;
+    fill_rect(0, 0, fb_w, h, 0xff000000);
+    for (int k = 0; k < ly->nkeys; k++)
+        if (ly->keys[k].label)
+            draw_key_face(&ly->keys[k], 0, shift, 0xff000000);
+    fb_draw = saved_draw;
+    clip_y0 = saved_y0;
+    clip_y1 = saved_y1;
+    dirty_y0 = saved_d0;
+    dirty_y1 = saved_d1;
+    ly->img[shift] = img;
+}
+
+/* 0 for a key drawn as in the keyboard image, else its background. */
+static uint32_t key_lit(int k) {
+    const struct key_info *ki = &kb->keys[k];
+    uint32_t ksym = shift_on ? ki->keysym_shift : ki->keysym;
+
+    int is_pressed = (k == pressed_key);
+    int is_mod = (ksym == 0xffe1 || ksym == 0xffe2 || ksym == 0xffe3 || ksym == 0xffe9);
+    int is_active = (is_mod && ((ksym == 0xffe1 || ksym == 0xffe2) ? shift_on : (ksym == 0xffe3 ? ctrl_on : alt_on)));
+    if (k == pressed_key && pad.active)
+        is_active = 1, is_pressed = 0;
+
+    return is_pressed ? 0xff404040 : (is_active ? 0xff303060 : 0);
+}
+
+static void draw_key(int k) {
+    if (render_inhibit || osk_hidden || osk_collapsed || k < 0) return;
+
+    const struct key_info *ki = &kb->keys[k];
+    uint32_t bg = key_lit(k);
+    if (bg) {
+        draw_key_face(ki, kb_y, shift_on, bg);
+        return;
+    }
+    size_t off = (size_t)ki->row * kh * fb_stride + ki->x * pix->bpp;
+    const uint8_t *src = kb->img[shift_on] + off;
+    uint8_t *dst = fb_draw + (size_t)kb_y * fb_stride + off;
+    for (int j = 0; j < kh; j++)
+        memcpy(dst + j * fb_stride, src + j * fb_stride, ki->w * pix->bpp);
+    mark_dirty(kb_y + ki->row * kh, kh);
+}
+
+static void draw_keyboard(void) {
+    if (render_inhibit || osk_hidden) return;
+    if (osk_collapsed) {
+        fill_rect(0, kb_y, fb_w, kb_height, 0xff000000);
+        fill_rect(fb_w / 2 - kw, kb_y + kb_height / 2 - 2, kw * 2, 4, 0xff606060);
+        return;
+    }
+    memcpy(fb_draw + (size_t)kb_y * fb_stride, kb->img[shift_on], (size_t)kb_rows * kh * fb_stride);
+    mark_dirty(kb_y, kb_rows * kh);
+    for (int k = 0; k < kb->nkeys; k++)
+        if (kb->keys[k].label && key_lit(k))
+            draw_key(k);
+}
+
+static void draw_glyph(int px, int py, uint32_t ch, uint32_t fg, uint32_t bg, unsigned int width) {
+    int total_w = width * cell_w;
+
+    fill_rect(px, py, total_w, cell_h, bg);
+
+    if (ch == 0 || ch == ' ')
+        return;
+
+    int w, h, xoff, yoff;
+    unsigned char *bmp = glyph_cache_get(ch, &w, &h, &xoff, &yoff);
+    if (!bmp) return;
+
+    int ascent, descent, linegap;
+    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
+    int baseline = py + (int)(ascent * font_scale);
+
+    draw_bitmap(px + xoff, baseline + yoff, bmp, w, h, fg);
+    if (ch >= GLYPH_CACHE_SIZE)
+        stbtt_FreeBitmap(bmp, NULL);
+}
+
+/* View row v is scrollback while v < sb_count and the live screen after
+ * that; v == -1 is the line above the view shown during a drag. */
+static const struct cell *view_row(int v) {
+    int back = sb_count - v;
+    if (back > 0) {
+        if ((size_t)back > sb.nlines) return NULL;
+        sb_decode(sb.nlines - back, row_buf, term_cols);
+        return row_buf;
+    }
+    return screen_cells + (v - sb_count) * term_cols;
+}
+
+static int search_prompt(char *out) {
+    int n = snprintf(out, SEARCH_MAX + 32, "%s: %s", search.regex ? "regex" : "search", search.query);
+    if (search.regex && search.len && !search.re_ok)
+        n += snprintf(out + n, 16, " (invalid)");
+    else if (search.len && !search.found)
+        n += snprintf(out + n, 16, " (no match)");
+    return n;
+}
+
+static uint64_t view_row_id(int v) {
+    if (search.active && v == term_rows - 1) {
+        char prompt[SEARCH_MAX + 32];
+        int n = search_prompt(prompt);
+        return memhash(prompt, n) | 1ULL << 62;
+    }
+    int back = sb_count - v;
+    uint64_t id;
+    if (back > 0) {
+        id = (sb.pushed - back) | 1ULL << 63;
+    } else {
+        int cx, cy;
+        cursor_get(&cx, &cy);
+        id = row_hash[v - sb_count];
+        if (!sb_count && v == cy)
+            id ^= (cx + 1) * 0x9e3779b97f4a7c15ULL;
+        if (pred_shown())
+            for (int i = 0; i < pred.n; i++)
+                if (pred.cell[i].y == v)
+                    id = (id ^ pred.cell[i].ch ^ (uint64_t)pred.cell[i].x << 32) * 0x100000001b3ULL;
+    }
+    struct mark m[SEARCH_MARKS + 1];
+    int n = search.active ? row_marks(v, view_row(v), m) : 0;
+    if (sel_span(v, &m[n].c0, &m[n].c1))
+        m[n++].kind = MARK_SELECTION;
+    if (n)
+        id ^= memhash(m, n * sizeof(*m)) + 1;
+    return id;
+}
+
+static void draw_search_prompt(int py) {
+    char prompt[SEARCH_MAX + 32];
+    int n = search_prompt(prompt);
+    const unsigned char *p = (const unsigned char *)prompt, *end = p + n;
+    int x = 0;
+    fill_rect(0, py, term_cols * cell_w, cell_h, 0xff303060);
+    for (; x < term_cols && p < end; x++)
+        draw_glyph(x * cell_w, py, utf8_decode(&p, end), 0xffffffff, 0xff303060, 1);
+    if (x < term_cols)
+        draw_glyph(x * cell_w, py, ' ', 0xff303060, 0xffffffff, 1);
+}
+
+static void draw_row_cells(const struct cell *cells, const struct mark *m, int nm, int py) {
+    for (int x = 0; x < term_cols; x++) {
+        if (!cells[x].width) continue;
+        uint32_t fg = cells[x].fg, bg = cells[x].bg;
+        for (int i = 0; i < nm; i++) {
+            if (x < m[i].c0 || x >= m[i].c1) continue;
+            if (m[i].kind == MARK_SELECTION) {
+                fg = 0xffffffff;
+                bg = 0xff3060a0;
+            } else {
+                fg = 0xff000000;
+                bg = m[i].kind == MARK_CURRENT ? 0xffffcc00 : 0xff808040;
+            }
+        }
+        draw_glyph(x * cell_w, py, cells[x].ch, fg, bg, cells[x].width);
+    }
+}
+
+/* Rendered scrollback rows, most recently used first. Stored lines never
+ * change, so a row is identified by its line number and the font size, and
+ * scrolling back over recently seen history is one copy per row. */
+struct lc_entry {
+    uint64_t line;
+    int font_size;
+    int prev, next, hnext;
+};
+
+static struct {
+    struct lc_entry *e;
+    int *buckets;
+    uint8_t *pixels;
+    size_t budget, row_bytes;
+    int stride, n, used, nbuckets, head, tail;
+    uint64_t hits, misses;
+} lc = {.budget = 4 << 20};
+
+static void lc_reset(void) {
+    free(lc.e);
+    free(lc.buckets);
+    free(lc.pixels);
+    lc.e = NULL;
+    lc.buckets = NULL;
+    lc.pixels = NULL;
+    lc.n = lc.used = 0;
+    lc.head = lc.tail = -1;
+    lc.stride = fb_w * pix->bpp;
+    lc.row_bytes = (size_t)lc.stride * cell_h;
+    int n = lc.row_bytes ? lc.budget / lc.row_bytes : 0;
+    if (n <= 0) return;
+    for (lc.nbuckets = 16; lc.nbuckets < n; lc.nbuckets *= 2)
+        ;
+    lc.e = malloc(n * sizeof(*lc.e));
+    lc.buckets = malloc(lc.nbuckets * sizeof(int));
+    lc.pixels = malloc(n * lc.row_bytes);
+    if (!lc.e || !lc.buckets || !lc.pixels) {
+        fprintf(stderr, "touchvt: line cache: out of memory\n");
+        return;
+    }
+    memset(lc.buckets, 0xff, lc.nbuckets * sizeof(int));
+    lc.n = n;
+}
+
+static inline int lc_bucket(uint64_t line) {
+    return (line * 0x9e3779b97f4a7c15ULL) >> 32 & (lc.nbuckets - 1);
+}
+
+static void lc_unlink(int i) {
+    struct lc_entry *e = &lc.e[i];
+    if (e->prev >= 0) lc.e[e->prev].next = e->next; else lc.head = e->next;
+    if (e->next >= 0) lc.e[e->next].prev = e->prev; else lc.tail = e->prev;
+}
+
+static void lc_push_front(int i) {
+    lc.e[i].prev = -1;
+    lc.e[i].next = lc.head;
+    if (lc.head >= 0) lc.e[lc.head].prev = i;
+    lc.head = i;
+    if (lc.tail < 0) lc.tail = i;
+}
+
+/* Returns the slot holding line, or claims the least recently used one and
+ * sets *miss so the caller renders into it. */
+static int lc_get(uint64_t line, int *miss) {
+    int b = lc_bucket(line);
+    for (int i = lc.buckets[b]; i >= 0; i = lc.e[i].hnext) {
+        if (lc.e[i].line == line && lc.e[i].font_size == current_font_size) {
+            lc_unlink(i);
+            lc_push_front(i);
+            lc.hits++;
+            *miss = 0;
+            return i;
+        }
+    }
+
+    int i;
+    if (lc.used < lc.n) {
+        i = lc.used++;
+    } else {
+        i = lc.tail;
+        lc_unlink(i);
+        int *pp = &lc.buckets[lc_bucket(lc.e[i].line)];
+        while (*pp != i)
+            pp = &lc.e[*pp].hnext;
+        *pp = lc.e[i].hnext;
+    }
+    lc.e[i].line = line;
+    lc.e[i].font_size = current_font_size;
+    lc.e[i].hnext = lc.buckets[b];
+    lc.buckets[b] = i;
+    lc_push_front(i);
+    lc.misses++;
+    *miss = 1;
+    return i;
+}
+
+static void draw_cached_row(uint64_t line, int v, int py) {
+    int miss;
+    int i = lc_get(line, &miss);
+    uint8_t *src = lc.pixels + i * lc.row_bytes;
+
+    if (miss) {
+        uint8_t *saved_draw = fb_draw;
+        int saved_stride = fb_stride, saved_y0 = clip_y0, saved_y1 = clip_y1;
+        int saved_d0 = dirty_y0, saved_d1 = dirty_y1;
+        fb_draw = src;
+        fb_stride = lc.stride;
+        clip_y0 = 0;
+        clip_y1 = cell_h;
+        draw_row_cells(view_row(v), NULL, 0, 0);
+        fb_draw = saved_draw;
+        fb_stride = saved_stride;
+        clip_y0 = saved_y0;
+        clip_y1 = saved_y1;
+        dirty_y0 = saved_d0;
+        dirty_y1 = saved_d1;
+    }
+
+    int y0 = py > clip_y0 ? py : clip_y0;
+    int y1 = py + cell_h < clip_y1 ? py + cell_h : clip_y1;
+    size_t w = (size_t)term_cols * cell_w * pix->bpp;
+    for (int y = y0; y < y1; y++)
+        memcpy(fb_draw + y * fb_stride, src + (y - py) * lc.stride, w);
+    if (y1 > y0)
+        mark_dirty(y0, y1 - y0);
+}
+
+static void draw_view_row(int v, int py) {
+    if (search.active && v == term_rows - 1) {
+        draw_search_prompt(py);
+        return;
+    }
+    struct mark m[SEARCH_MARKS + 1];
+    int back = sb_count - v, a = 0, b = 0;
+    int selected = sel_span(v, &a, &b);
+    if (back > 0 && (size_t)back <= sb.nlines && lc.n && !(search.active && search.len) && !selected) {
+        draw_cached_row(sb.pushed - back, v, py);
+        return;
+    }
+    const struct cell *cells = view_row(v);
+    if (!cells) {
+        fill_rect(0, py, term_cols * cell_w, cell_h, 0xff000000);
+        return;
+    }
+    int nm = search.active ? row_marks(v, cells, m) : 0;
+    if (selected)
+        m[nm++] = (struct mark){a, b, MARK_SELECTION};
+    draw_row_cells(cells, m, nm, py);
+
+    if (pred_shown()) {
+        for (int i = 0; i < pred.n; i++) {
+            if (pred.cell[i].y != v) continue;
+            const struct cell *c = &cells[pred.cell[i].x];
+            draw_glyph(pred.cell[i].x * cell_w, py, pred.cell[i].ch, c->fg, c->bg, 1);
+            fill_rect(pred.cell[i].x * cell_w, py + cell_h - 2, cell_w, 1, c->fg);
+        }
+    }
+
+    int cx, cy;
+    cursor_get(&cx, &cy);
+    if (!sb_count && v == cy && cx < term_cols) {
+        const struct cell *c = &cells[cx];
+        if (!c->width && cx > 0)
+            c = &cells[--cx];
+        draw_glyph(cx * cell_w, py, c->ch, c->bg, c->fg, c->width ? c->width : 1);
+    }
+}
+
+/* Renders the pixel rows [y0, y1) of the terminal area. While a drag is in
+ * progress the content is shifted down by scroll_px, so the line above the
+ * view is partially visible and the bottom row is cut off. */
+static void draw_terminal_band(int y0, int y1) {
+    int h = term_rows * cell_h;
+    if (y0 < 0) y0 = 0;
+    if (y1 > h) y1 = h;
+    if (render_inhibit || y0 >= y1) return;
+
+    clip_y0 = y0;
+    clip_y1 = y1;
+    int lo = (y0 - scroll_px + cell_h) / cell_h - 1;
+    int hi = (y1 - scroll_px + cell_h - 1) / cell_h;
+    if (hi > term_rows) hi = term_rows;
+    for (int v = lo; v < hi; v++)
+        draw_view_row(v, v * cell_h + scroll_px);
+    clip_y0 = 0;
+    clip_y1 = fb_h;
+}
+
+/* Records what each row shows so draw_terminal_damage() can skip the rows
+ * that did not change. Only meaningful while the view is line aligned. */
+static void drawn_update(void) {
+    drawn_valid = !scroll_px && !render_inhibit;
+    if (!drawn_valid) return;
+    for (int v = 0; v < term_rows; v++)
+        drawn_id[v] = view_row_id(v);
+}
+
+static void draw_terminal(void) {
+    draw_terminal_band(0, term_rows * cell_h);
+    out_shift = 0;
+    drawn_update();
+}
+
+static void timer_arm(int fd, int first_ms, int interval_ms) {
+    struct itimerspec its = {
+        .it_value = {first_ms / 1000, (first_ms % 1000) * 1000000L},
+        .it_interval = {interval_ms / 1000, (interval_ms % 1000) * 1000000L}};
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+static void redraw_all(void) {
+    popup.shown = 0;
+    if (render_inhibit) return;
+    fill_rect(0, 0, fb_w, fb_h, 0xff000000);
+    draw_keyboard();
+    draw_terminal();
+}
+
+static void render_resume(unsigned int reason) {
+    if (!(render_inhibit & reason)) return;
+    render_inhibit &= ~reason;
+    redraw_all();
+}
+
+static void blit_rows(int dst_y, int src_y, int h) {
+    if (render_inhibit || h <= 0) return;
+    memmove(fb_draw + dst_y * fb_stride, fb_draw + src_y * fb_stride, (size_t)h * fb_stride);
+    mark_dirty(dst_y, h);
+}
+
+/* Brings the terminal area up to date after PTY output. Lines that scrolled
+ * off while following the output are moved with one blit, then only rows
+ * whose content differs from what was drawn are rendered. */
+static void draw_terminal_damage(void) {
+    if (render_inhibit) return;
+    if (!drawn_valid || scroll_px) {
+        draw_terminal();
+        return;
+    }
+    int shift = out_shift;
+    out_shift = 0;
+    if (shift > 0 && shift < term_rows) {
+        blit_rows(0, shift * cell_h, (term_rows - shift) * cell_h);
+        memmove(drawn_id, drawn_id + shift, (term_rows - shift) * sizeof(*drawn_id));
+        for (int v = term_rows - shift; v < term_rows; v++)
+            drawn_id[v] = 0;
+    }
+    for (int v = 0; v < term_rows; v++) {
+        uint64_t id = view_row_id(v);
+        if (id == drawn_id[v]) continue;
+        draw_terminal_band(v * cell_h, (v + 1) * cell_h);
+        drawn_id[v] = id;
+    }
+}
+
+static void search_run(uint64_t line, int pos, int dir, int restart) {
+    double t0 = now_ms();
+    if (search.len && search_find(line, pos, dir)) {
+        search.found = 1;
+        int64_t v = (int64_t)(search.line - sb.pushed) + sb_count;
+        if (v < 0 || v >= term_rows - 1) {
+            int64_t sc = term_rows / 2 - (int64_t)(search.line - sb.pushed);
+            if (sc < 0) sc = 0;
+            if (sc > (int64_t)sb.nlines) sc = sb.nlines;
+            sb_count = sc;
+        }
+    } else if (restart) {
+        search.found = 0;
+    }
+    search.last_ms = now_ms() - t0;
+    term_damaged = 1;
+}
+
+/* Re-runs the query from the current match, or from the bottom of the view,
+ * after it was edited. */
+static void search_restart(void) {
+    search_compile();
+    if (search.found)
+        search_run(search.line, search.so + 1, -1, 1);
+    else
+        search_run(sb.pushed - sb_count + term_rows - 1, INT32_MAX, -1, 1);
+}
+
+static void search_toggle(void) {
+    search.active = !search.active;
+    search.len = 0;
+    search.found = 0;
+    search_compile();
+    scroll_px = 0;
+    term_damaged = 1;
+}
+
+/* Returns whether holding the key should repeat it. */
+static int search_key(uint32_t ksym) {
+    uint32_t u;
+    if (ksym == 0xff1b) {
+        search_toggle();
+        return 0;
+    } else if (ksym == 0xff09) {
+        search.regex = !search.regex;
+        search_restart();
+    } else if (ksym == 0x007f) {
+        while (search.len > 0 && (search.query[--search.len] & 0xc0) == 0x80)
+            ;
+        search_restart();
+    } else if (ksym == 0xff0d || ksym == 0xff52) {
+        if (search.found)
+            search_run(search.line, search.so, -1, 0);
+    } else if (ksym == 0xff54) {
+        if (search.found)
+            search_run(search.line, search.so, 1, 0);
+    } else if ((u = keysym_unicode(ksym)) >= 0x20 && (u < 0x7f || u >= 0xa0) && search.len + 4 < SEARCH_MAX) {
+        search.len += utf8_encode(u, (unsigned char *)search.query + search.len);
+        search_restart();
+    }
+    return ksym != 0xff09;
+}
+
+/* Moves the view dy pixels into (positive) or out of the scrollback. The
+ * pixels that stay visible are shifted in place and only the exposed band is
+ * rendered, which is at most one new line per motion event. Returns the
+ * distance actually scrolled. */
+static int scroll_by_px(int dy) {
+    int old_sb = sb_count, old_pos = sb_count * cell_h + scroll_px;
+    int pos = old_pos + dy;
+    if (pos > (int)sb.nlines * cell_h) pos = sb.nlines * cell_h;
+    if (pos < 0) pos = 0;
+    int shift = pos - old_pos;
+    if (!shift) return 0;
+
+    sb_count = pos / cell_h;
+    scroll_px = pos % cell_h;
+
+    int h = term_rows * cell_h;
+    if (abs(shift) >= h) {
+        draw_terminal();
+        return shift;
+    }
+    if (shift > 0) {
+        blit_rows(shift, 0, h - shift);
+        draw_terminal_band(0, shift);
+    } else {
+        blit_rows(0, -shift, h + shift);
+        draw_terminal_band(h + shift, h);
+    }
+
+    if (!old_sb != !sb_count) {
+        int cx, cy;
+        cursor_get(&cx, &cy);
+        cy = cy * cell_h + pos;
+        draw_terminal_band(cy, cy + cell_h);
+    }
+    drawn_update();
+    return shift;
+}
+
+static void scroll_snap(void) {
+    if (scroll_px)
+        scroll_by_px(scroll_px >= cell_h / 2 ? cell_h - scroll_px : -scroll_px);
+}
+
+#define VEL_SAMPLES 8
+#define VEL_WINDOW_US 100000
+#define FLING_MIN_V 300.0
+#define FLING_STOP_V 40.0
+#define FLING_TAU_MS 325.0
+
+static struct {
+    uint64_t usec[VEL_SAMPLES];
+    int y[VEL_SAMPLES];
+    int n;
+} vel;
+
+static struct {
+    double v, off, t;
+    int active;
+} fling;
+static int fling_tfd = -1;
+
+static void vel_add(uint64_t usec, int y) {
+    int i = vel.n++ % VEL_SAMPLES;
+    vel.usec[i] = usec;
+    vel.y[i] = y;
+}
+
+/* Finger speed in px/s over the last VEL_WINDOW_US of samples, or 0 if the
+ * finger rested before lifting. */
+static double vel_estimate(uint64_t up_usec) {
+    if (vel.n < 2) return 0;
+    int count = vel.n < VEL_SAMPLES ? vel.n : VEL_SAMPLES;
+    int last = (vel.n - 1) % VEL_SAMPLES, first = last;
+    if (up_usec - vel.usec[last] > VEL_WINDOW_US / 2) return 0;
+    for (int k = 1; k < count; k++) {
+        int i = (vel.n - 1 - k) % VEL_SAMPLES;
+        if (vel.usec[last] - vel.usec[i] > VEL_WINDOW_US) break;
+        first = i;
+    }
+    uint64_t dt = vel.usec[last] - vel.usec[first];
+    return dt ? (vel.y[last] - vel.y[first]) * 1e6 / dt : 0;
+}
+
+static void fling_stop(void) {
+    if (!fling.active) return;
+    fling.active = 0;
+    timer_arm(fling_tfd, 0, 0);
+}
+
+static int fling_start(double v) {
+    if (fabs(v) < FLING_MIN_V) return 0;
+    fling.v = v;
+    fling.off = 0;
+    fling.t = now_ms();
+    fling.active = 1;
+    timer_arm(fling_tfd, 16, 16);
+    return 1;
+}
+
+static void fling_tick(void) {
+    uint64_t expirations;
+    if (read(fling_tfd, &expirations, sizeof(expirations)) < 0 || !fling.active) return;
+
+    double t = now_ms(), dt = t - fling.t;
+    fling.t = t;
+    fling.off += fling.v * dt / 1000;
+    fling.v *= exp(-dt / FLING_TAU_MS);
+
+    int dy = (int)fling.off;
+    fling.off -= dy;
+    if ((dy && !scroll_by_px(dy)) || fabs(fling.v) < FLING_STOP_V) {
+        fling_stop();
+        scroll_snap();
+    }
+}
+
+static void drag_apply(void) {
+    if (last_touch_y == -1 || touch_y == last_touch_y) return;
+    scroll_by_px(touch_y - last_touch_y);
+    last_touch_y = touch_y;
+}
+
+/* With VT_PROCESS the kernel waits for us to acknowledge a switch, so
+ * rendering stops before the release is confirmed and the whole screen is
+ * repainted once from the current tsm state when we get the VT back. */
+static void vt_process_switch(void) {
+    if (vt_release_req) {
+        vt_release_req = 0;
+        render_inhibit |= INHIBIT_VT;
+        pressed_key = -1;
+        pad.armed = pad.active = 0;
+        popup.armed = popup.shown = 0;
+        mouse.down = 0;
+        alt.active = 0;
+        sel.pending = sel.dragging = 0;
+        last_touch_y = -1;
+        fling_stop();
+        ioctl(vt_fd, VT_RELDISP, 1);
+    }
+    if (vt_acquire_req) {
+        vt_acquire_req = 0;
+        ioctl(vt_fd, VT_RELDISP, VT_ACKACQ);
+        ioctl(fb_fd, FBIOPAN_DISPLAY, &vinfo);
+        render_resume(INHIBIT_VT);
+    }
+}
+
+/* Terminal sessions. The one shown lives in the globals above and the rest
+ * are parked in sessions[]; session_use() swaps a parked one in to parse
+ * its output or resize it, and again to put it back. Parked sessions are
+ * never drawn. The font, glyph cache, keyboard and clipboard are shared. */
+#define MAX_SESSIONS 8
+#define SWAP(a, b) do { __typeof__(a) swap_tmp = (a); (a) = (b); (b) = swap_tmp; } while (0)
+
+static struct session {
+    struct tsm_screen *screen;
+    struct tsm_vte *vte;
+    int pty;
+    pid_t pid;
+    struct cell *cells, *next;
+    uint64_t *hash, *hash_next;
+    __typeof__(sb) sb;
+    int sb_count, out_shift;
+    uint32_t modes;
+    double sync_since;
+    __typeof__(scan) scan;
+    __typeof__(osc52) osc52;
+    __typeof__(pred) pred;
+    __typeof__(pty_out) pty_out;
+    __typeof__(paste) paste;
+} sessions[MAX_SESSIONS];
+static int nsessions = 1, cur_session;
+
+static void session_swap(struct session *s) {
+    SWAP(tsm_screen, s->screen);
+    SWAP(tsm_vte, s->vte);
+    SWAP(pty_master, s->pty);
+    SWAP(child_pid, s->pid);
+    SWAP(screen_cells, s->cells);
+    SWAP(screen_next, s->next);
+    SWAP(row_hash, s->hash);
+    SWAP(row_hash_next, s->hash_next);
+    SWAP(sb, s->sb);
+    SWAP(sb_count, s->sb_count);
+    SWAP(out_shift, s->out_shift);
+    SWAP(term_modes, s->modes);
+    SWAP(sync_out.since, s->sync_since);
+    SWAP(scan, s->scan);
+    SWAP(osc52, s->osc52);
+    SWAP(pred, s->pred);
+    SWAP(pty_out, s->pty_out);
+    SWAP(paste, s->paste);
+}
+
+static void session_use(int i) {
+    if (i != cur_session)
+        session_swap(&sessions[i]);
+}
+
+static int session_new(void) {
+    if (tsm_screen_new(&tsm_screen, NULL, NULL) < 0) {
+        fprintf(stderr, "touchvt: tsm_screen_new failed\n");
+        return -1;
+    }
+    tsm_screen_set_max_sb(tsm_screen, 0);
+    if (sb_init(sb_spill_dir) < 0) {
+        fprintf(stderr, "touchvt: scrollback: out of memory\n");
+        return -1;
+    }
+    if (tsm_vte_new(&tsm_vte, tsm_screen, vte_write_cb, NULL, NULL, NULL) < 0) {
+        fprintf(stderr, "touchvt: tsm_vte_new failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Runs cmd, or the user's shell, on a new PTY. */
+static int session_spawn(char **cmd) {
+    struct winsize ws = {.ws_row = term_rows,
+        .ws_col = term_cols,
+        .ws_xpixel = term_cols * cell_w,
+        .ws_ypixel = term_rows * cell_h};
+    child_pid = forkpty(&pty_master, NULL, NULL, &ws);
+    if (child_pid < 0) {
+        perror("touchvt: forkpty");
+        return -1;
+    }
+    if (child_pid == 0) {
+        setenv("TERM", "xterm-256color", 1);
+        if (active_vt != -1) {
+            char vtnr[16];
+            snprintf(vtnr, sizeof(vtnr), "%d", active_vt);
+            setenv("XDG_VTNR", vtnr, 1);
+        }
+        setenv("XDG_SESSION_TYPE", "tty", 1);
+        setenv("XDG_SEAT", "seat0", 1);
+        if (cmd) {
+            execvp(cmd[0], cmd);
+            perror("touchvt: execvp");
+            _exit(127);
+        }
+        char *shell = getenv("SHELL");
+        if (!shell) shell = "/bin/sh";
+        execlp(shell, shell, NULL);
+        _exit(127);
+    }
+    fcntl(pty_master, F_SETFL, O_NONBLOCK);
+    fcntl(pty_master, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+static void session_free(void) {
+    close(pty_master);
+    tsm_vte_unref(tsm_vte);
+    tsm_screen_unref(tsm_screen);
+    sb_free();
+    free(screen_cells);
+    free(screen_next);
+    free(row_hash);
+    free(row_hash_next);
+    free(osc52.buf);
+    free(pty_out.buf);
+    free(paste.buf);
+}
+
+/* Fits the session in the globals to the terminal area. Lines a shrink
+ * pushes off the top, which libtsm would drop, go to the scrollback;
+ * returns how many there were. */
+static int session_resize(int old_cols) {
+    int lost = (int)tsm_screen_get_cursor_y(tsm_screen) - term_rows + 1;
+    if (screen_cells && !(tsm_screen_get_flags(tsm_screen) & TSM_SCREEN_ALTERNATE))
+        for (int r = 0; r < lost; r++)
+            sb_push(screen_cells + r * old_cols, old_cols);
+    if ((size_t)sb_count > sb.nlines) sb_count = sb.nlines;
+    /* Predictions point at cells of the old grid. */
+    pred.n = 0;
+
+    tsm_screen_resize(tsm_screen, term_cols, term_rows);
+    screen_alloc();
+    screen_snapshot();
+    screen_commit();
+    struct winsize ws = {.ws_row = term_rows,
+        .ws_col = term_cols,
+        .ws_xpixel = term_cols * cell_w,
+        .ws_ypixel = term_rows * cell_h};
+    ioctl(pty_master, TIOCSWINSZ, &ws);
+    return lost > 0 ? lost : 0;
+}
+
+/* Starts a shell in a new parked session. */
+static int session_add(void) {
+    struct session *s = &sessions[nsessions];
+    size_t ram_budget = sb.ram_budget;
+    int pred_mode = pred.mode;
+    session_swap(s);
+    pty_master = -1;
+    child_pid = -1;
+    sb.spill_fd = -1;
+    sb.ram_budget = ram_budget;
+    pred.mode = pred_mode;
+    int ret = session_new();
+    if (ret == 0) {
+        session_resize(term_cols);
+        ret = session_spawn(NULL);
+    }
+    session_swap(s);
+    if (ret == 0)
+        nsessions++;
+    return ret;
+}
+
+/* Drops what belonged to the session that was shown and paints the new one
+ * right away, so it is on screen with the next flush. */
+static void session_shown(void) {
+    pad.armed = pad.active = 0;
+    popup.armed = 0;
+    mouse.down = 0;
+    alt.active = 0;
+    sel.active = sel.pending = sel.dragging = 0;
+    last_touch_y = -1;
+    fling_stop();
+    scroll_px = 0;
+    lc_reset();
+    drawn_valid = 0;
+    if (search.active) {
+        search.found = 0;
+        search_restart();
+    }
+    redraw_all();
+}
+
+static void session_switch(int i) {
+    if (i == cur_session || i < 0 || i >= nsessions) return;
+    session_swap(&sessions[cur_session]);
+    session_swap(&sessions[i]);
+    cur_session = i;
+    session_shown();
+}
+
+static void session_step(int d) {
+    session_switch((cur_session + d + nsessions) % nsessions);
+}
+
+/* Called once the session's child has exited. Closing the shown session
+ * shows its neighbour. */
+static void session_close(int i) {
+    session_use(i);
+    session_free();
+    session_use(i);
+    memmove(&sessions[i], &sessions[i + 1], (nsessions - i - 1) * sizeof(*sessions));
+    nsessions--;
+    memset(&sessions[nsessions], 0, sizeof(*sessions));
+    if (i < cur_session) {
+        cur_session--;
+    } else if (i == cur_session && nsessions) {
+        if (cur_session == nsessions)
+            cur_session--;
+        session_swap(&sessions[cur_session]);
+        memset(&sessions[cur_session], 0, sizeof(*sessions));
+        session_shown();
+    }
+}
+
+static void session_reap(void) {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (int i = 0; i < nsessions; i++)
+            if ((i == cur_session ? child_pid : sessions[i].pid) == pid) {
+                session_close(i);
+                break;
+            }
+}
+
+/* Fits the terminal to the space above the keyboard, in every session.
+ * Returns how many lines the shown one pushed into its scrollback. */
+static int term_resize(void) {
+    kb_height = osk_hidden ? 0 : osk_collapsed ? kh / 3 : kb_rows * kh;
+    kb_y = fb_h - kb_height;
+
+    int old_cols = term_cols;
+    term_height = kb_y;
+    term_cols = fb_w / cell_w;
+    term_rows = term_height / cell_h;
+    if (!tsm_screen) return 0;
+
+    for (int i = 0; i < nsessions; i++) {
+        if (i == cur_session) continue;
+        session_use(i);
+        session_resize(old_cols);
+        session_use(i);
+    }
+    lc_reset();
+    return session_resize(old_cols);
+}
+
+/* Lays each row's keys out across the screen in proportion to their
+ * widths, then rebuilds the hit-test grids and renders every layer, so no
+ * layer switch has to draw keys. */
+static void kb_place(void) {
+    float widest = 1;
+    kb_rows = 0;
+    for (int l = 0; l < kb_nlayers; l++) {
+        struct kb_layer *ly = &kb_layers[l];
+        free(ly->img[0]);
+        free(ly->img[1]);
+        ly->img[0] = ly->img[1] = NULL;
+        int rows = 0;
+        for (int k = 0, start = 0; k < ly->nkeys; k++) {
+            if (ly->keys[k].label) continue;
+            float units = 0;
+            for (int i = start; i < k; i++)
+                units += ly->keys[i].width > 0 ? ly->keys[i].width : 1;
+            if (units > widest) widest = units;
+            float at = 0;
+            for (int i = start; i < k; i++) {
+                struct key_info *ki = &ly->keys[i];
+                ki->row = rows;
+                ki->x = (int)(at * fb_w / units + 0.5f);
+                at += ki->width > 0 ? ki->width : 1;
+                ki->w = (int)(at * fb_w / units + 0.5f) - ki->x;
+                ki->label_w = text_width(ki->label);
+                ki->label_shift_w = text_width(ki->label_shift);
+            }
+            rows++;
+            start = k + 1;
+        }
+        if (rows > kb_rows) kb_rows = rows;
+    }
+    kw = (int)(fb_w / widest);
+
+    for (int l = 0; l < kb_nlayers; l++) {
+        struct kb_layer *ly = &kb_layers[l];
+        uint16_t *hit = realloc(ly->hit, (size_t)kb_rows * fb_w * sizeof(*hit));
+        if (!hit) {
+            fprintf(stderr, "touchvt: out of memory\n");
+            exit(1);
+        }
+        ly->hit = hit;
+        /* Rows a layer does not have hit nothing. */
+        memset(hit, 0xff, (size_t)kb_rows * fb_w * sizeof(*hit));
+        for (int k = 0; k < ly->nkeys; k++) {
+            const struct key_info *ki = &ly->keys[k];
+            if (!ki->label) continue;
+            for (int x = ki->x; x < ki->x + ki->w; x++)
+                hit[ki->row * fb_w + x] = k;
+        }
+        kb_render(ly, 0);
+        kb_render(ly, 1);
+    }
+}
+
+static void kb_switch(int layer) {
+    if (layer < 0 || layer >= kb_nlayers) return;
+    kb = &kb_layers[layer];
+    pressed_key = -1;
+    draw_keyboard();
+}
+
+/* Splits a layout line into words in place. Double quotes group words and
+ * keep a leading word from being read as an option; backslash escapes the
+ * next character inside them. Returns the word count, or -1. */
+static int split_words(char *s, char **word, int *quoted, int max) {
+    int n = 0;
+    for (;;) {
+        while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+        if (!*s || *s == '#') return n;
+        if (n == max) return -1;
+        quoted[n] = *s == '"';
+        word[n++] = s;
+        char *out = s;
+        int q = 0;
+        while (*s && (q || !strchr(" \t\r\n", *s))) {
+            if (*s == '"') {
+                q = !q;
+                s++;
+                continue;
+            }
+            if (q && *s == '\\' && s[1]) s++;
+            *out++ = *s++;
+        }
+        if (q) return -1;
+        if (*s) s++;
+        *out = 0;
+    }
+}
+
+/* A keysym is an XKB name or a 0x number; a label that is one character
+ * stands for that character. */
+static uint32_t parse_keysym(const char *s) {
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+        return strtoul(s, NULL, 16);
+    return xkb_keysym_from_name(s, XKB_KEYSYM_NO_FLAGS);
+}
+
+static uint32_t label_keysym(const char *label) {
+    const unsigned char *p = (const unsigned char *)label, *end = p + strlen(label);
+    if (p == end) return 0;
+    uint32_t c = utf8_decode(&p, end);
+    return p == end ? xkb_utf32_to_keysym(c) : 0;
+}
+
+static int kb_layer_index(char **names, int *n, const char *name) {
+    for (int i = 0; i < *n; i++)
+        if (names[i] && strcmp(names[i], name) == 0) return i;
+    if (*n == KB_MAX_LAYERS) return -1;
+    names[*n] = strdup(name);
+    return (*n)++;
+}
+
+/* Reads a layout file made of these lines:
+ *
+ *   # comment
+ *   layer NAME
+ *   row
+ *   key LABEL [SHIFT-LABEL] [sym=KEYSYM] [shift-sym=KEYSYM]
+ *       [text=STRING] [shift-text=STRING] [alts=STRING] [shift-alts=STRING]
+ *       [width=UNITS] [layer=NAME]
+ *
+ * The first layer is the one shown at start. A key switches to a layer,
+ * types text, or sends its keysym, in that order of preference. alts
+ * lists the space separated strings offered when the key is held. Labels
+ * that contain '=' or start with '#' must be quoted. */
+/* Frees a key table read by kb_load, strings included. */
+static void kb_free_keys(struct key_info *keys, int n) {
+    for (int k = 0; k < n; k++) {
+        free((char *)keys[k].label);
+        free((char *)keys[k].label_shift);
+        free((char *)keys[k].text);
+        free((char *)keys[k].text_shift);
+        free((char *)keys[k].alts);
+        free((char *)keys[k].alts_shift);
+    }
+    free(keys);
+}
+
+static int kb_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "touchvt: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct {
+        struct key_info *keys;
+        int n, cap, row_keys;
+    } ly[KB_MAX_LAYERS] = {{0}};
+    char *names[KB_MAX_LAYERS] = {NULL};
+    int nnames = 1, cur = -1, lineno = 0;
+    const char *err = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    while (!err && getline(&line, &line_cap, f) >= 0) {
+        lineno++;
+        char *word[16];
+        int quoted[16];
+        int nw = split_words(line, word, quoted, 16);
+        if (nw <= 0) {
+            if (nw < 0) err = "unbalanced quotes or too many words";
+            continue;
+        }
+        if (strcmp(word[0], "layer") == 0 && !quoted[0]) {
+            if (nw != 2) {
+                err = "expected one layer name";
+            } else if (cur < 0) {
+                names[0] = strdup(word[1]);
+                cur = 0;
+            } else if ((cur = kb_layer_index(names, &nnames, word[1])) < 0) {
+                err = "too many layers";
+            }
+            if (err) break;
+            continue;
+        }
+        if (cur < 0) cur = 0;
+        if (ly[cur].n + 2 > ly[cur].cap) {
+            ly[cur].cap = ly[cur].cap ? ly[cur].cap * 2 : 64;
+            struct key_info *k = realloc(ly[cur].keys, ly[cur].cap * sizeof(*k));
+            if (!k) {
+                err = "out of memory";
+                break;
+            }
+            ly[cur].keys = k;
+        }
+        if (strcmp(word[0], "row") == 0 && !quoted[0]) {
+            if (ly[cur].row_keys)
+                ly[cur].keys[ly[cur].n++] = (struct key_info){0};
+            ly[cur].row_keys = 0;
+            continue;
+        }
+        if (strcmp(word[0], "key") != 0 || quoted[0]) {
+            err = "expected layer, row or key";
+            break;
+        }
+
+        struct key_info ki = {0};
+        const char *sym = NULL, *shift_sym = NULL;
+        for (int i = 1; i < nw && !err; i++) {
+            char *eq = quoted[i] ? NULL : strchr(word[i], '=');
+            if (!eq) {
+                if (!ki.label)
+                    ki.label = word[i];
+                else if (!ki.label_shift)
+                    ki.label_shift = word[i];
+                else
+                    err = "too many labels";
+                continue;
+            }
+            *eq++ = 0;
+            if (strcmp(word[i], "sym") == 0)
+                sym = eq;
+            else if (strcmp(word[i], "shift-sym") == 0)
+                shift_sym = eq;
+            else if (strcmp(word[i], "text") == 0)
+                ki.text = eq;
+            else if (strcmp(word[i], "shift-text") == 0)
+                ki.text_shift = eq;
+            else if (strcmp(word[i], "alts") == 0)
+                ki.alts = eq;
+            else if (strcmp(word[i], "shift-alts") == 0)
+                ki.alts_shift = eq;
+            else if (strcmp(word[i], "layer") == 0 && (ki.layer = kb_layer_index(names, &nnames, eq) + 1) > 0)
+                ;
+            else if (strcmp(word[i], "width") == 0 && (ki.width = strtof(eq, NULL)) > 0 && ki.width <= 16)
+                ;
+            else
+                err = "bad key option or too many layers";
+        }
+        if (err) break;
+        if (!ki.label) {
+            err = "key without a label";
+            break;
+        }
+        ki.keysym = sym ? parse_keysym(sym) : label_keysym(ki.label);
+        if (shift_sym)
+            ki.keysym_shift = parse_keysym(shift_sym);
+        else if (ki.label_shift)
+            ki.keysym_shift = label_keysym(ki.label_shift);
+        if (!ki.keysym_shift && !shift_sym) ki.keysym_shift = ki.keysym;
+        if (!ki.label_shift) ki.label_shift = ki.label;
+        if (!ki.text_shift) ki.text_shift = ki.text;
+        if (!ki.alts_shift) ki.alts_shift = ki.alts;
+        if ((sym && !ki.keysym) || (shift_sym && !ki.keysym_shift)) {
+            err = "unknown keysym";
+            break;
+        }
+        if (!ki.keysym && !ki.text && !ki.layer) {
+            err = "key sends nothing";
+            break;
+        }
+        ki.label = strdup(ki.label);
+        ki.label_shift = strdup(ki.label_shift);
+        if (ki.text) ki.text = strdup(ki.text);
+        if (ki.text_shift) ki.text_shift = strdup(ki.text_shift);
+        if (ki.alts) ki.alts = strdup(ki.alts);
+        if (ki.alts_shift) ki.alts_shift = strdup(ki.alts_shift);
+        ly[cur].keys[ly[cur].n++] = ki;
+        ly[cur].row_keys++;
+    }
+    for (int l = 0; l < nnames && !err; l++) {
+        if (ly[l].row_keys)
+            ly[l].keys[ly[l].n++] = (struct key_info){0};
+        if (!ly[l].n)
+            err = l ? "a layer that keys switch to has no keys" : "no keys";
+        else if (ly[l].n > 0xffff)
+            err = "too many keys";
+    }
+    free(line);
+    fclose(f);
+    for (int l = 0; l < nnames; l++)
+        free(names[l]);
+    if (err) {
+        fprintf(stderr, "touchvt: %s:%d: %s\n", path, lineno, err);
+        for (int l = 0; l < nnames; l++)
+            kb_free_keys(ly[l].keys, ly[l].n);
+        return -1;
+    }
+    if (kb_loaded)
+        for (int l = 0; l < kb_nlayers; l++)
+            kb_free_keys(kb_layers[l].keys, kb_layers[l].nkeys);
+    kb_loaded = 1;
+    for (int l = 0; l < nnames; l++) {
+        kb_layers[l].keys = ly[l].keys;
+        kb_layers[l].nkeys = ly[l].n;
+    }
+    kb_nlayers = nnames;
+    kb = kb_layers;
+    return 0;
+}
+
+static void resize_layout(int size) {
+    if (size < 8) size = 8;
+    if (size > 64) size = 64;
+    current_font_size = size;
+
+    glyph_cache_clear();
+    font_scale = stbtt_ScaleForPixelHeight(&font, current_font_size);
+
+    int ascent, descent, linegap;
+    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
+    cell_h = (int)((ascent - descent + linegap) * font_scale) + 2;
+
+    int advance, lsb;
+    stbtt_GetCodepointHMetrics(&font, 'M', &advance, &lsb);
+    cell_w = (int)(advance * font_scale);
+
+    kh = (int)(2.6 * current_font_size);
+    kb_place();
+
+    scroll_px = 0;
+    term_resize();
+    if (tsm_screen)
+        redraw_all();
+}
+
+/* Moves the top edge of the keyboard without a full repaint. Rows that stay
+ * visible are kept, blitted up by the lines a shrink pushed into the
+ * scrollback, so only rows that changed and the keyboard itself are drawn. */
+static void kb_relayout(void) {
+    int old_rows = term_rows;
+    uint64_t *old_id = drawn_valid && !scroll_px ? malloc(old_rows * sizeof(*old_id)) : NULL;
+    if (old_id)
+        memcpy(old_id, drawn_id, old_rows * sizeof(*old_id));
+
+    popup.shown = 0;
+    scroll_px = 0;
+    int lost = term_resize();
+    if (render_inhibit) {
+        free(old_id);
+        return;
+    }
+    int keep = old_rows - lost < term_rows ? old_rows - lost : term_rows;
+    if (old_id && keep > 0) {
+        if (lost)
+            blit_rows(0, lost * cell_h, keep * cell_h);
+        for (int v = 0; v < term_rows; v++)
+            drawn_id[v] = v < keep ? old_id[v + lost] : 0;
+        drawn_valid = 1;
+    }
+    free(old_id);
+
+    fill_rect(0, term_rows * cell_h, fb_w, kb_y - term_rows * cell_h, 0xff000000);
+    draw_keyboard();
+    draw_terminal_damage();
+}
+
+static void osk_set(int hidden, int collapsed) {
+    if (hidden == osk_hidden && collapsed == osk_collapsed) return;
+    osk_hidden = hidden;
+    osk_collapsed = collapsed;
+    pressed_key = -1;
+    pad.armed = pad.active = 0;
+    popup.armed = 0;
+    shift_on = 0;
+    kb_relayout();
+}
+
+static void backlight_open(void) {
+    DIR *d = opendir("/sys/class/backlight");
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        char path[300];
+        snprintf(path, sizeof(path), "/sys/class/backlight/%s/bl_power", de->d_name);
+        bl_power_fd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "/sys/class/backlight/%s/actual_brightness", de->d_name);
+        bl_bright_fd = open(path, O_RDONLY | O_CLOEXEC);
+        break;
+    }
+    closedir(d);
+}
+
+static int backlight_off(void) {
+    char buf[16];
+    ssize_t n;
+    if (bl_power_fd >= 0 && (n = pread(bl_power_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = 0;
+        if (atoi(buf) != FB_BLANK_UNBLANK) return 1;
+    }
+    if (bl_bright_fd >= 0 && (n = pread(bl_bright_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = 0;
+        if (atoi(buf) == 0) return 1;
+    }
+    return 0;
+}
+
+static void blank_idle_rearm(void) {
+    if (!(render_inhibit & INHIBIT_BLANK))
+        timer_arm(blank_tfd, blank_timeout * 1000, 0);
+}
+
+static void blank_set(int on) {
+    if (on) {
+        ioctl(fb_fd, FBIOBLANK, FB_BLANK_POWERDOWN);
+        blanked_by_us = 1;
+        render_inhibit |= INHIBIT_BLANK;
+        timer_arm(blank_tfd, 0, 0);
+    } else {
+        ioctl(fb_fd, FBIOBLANK, FB_BLANK_UNBLANK);
+        blanked_by_us = 0;
+        render_resume(INHIBIT_BLANK);
+        blank_idle_rearm();
+    }
+}
+
+/* Someone else (a power key daemon, the kernel) may switch the panel off
+ * behind our back. Output keeps being parsed while it is dark, but nothing
+ * is rasterized until the backlight comes back. */
+static void blank_check(void) {
+    if (blanked_by_us || (bl_power_fd < 0 && bl_bright_fd < 0)) return;
+    blank_checked_ms = now_ms();
+    int off = backlight_off();
+    if (off && !(render_inhibit & INHIBIT_BLANK)) {
+        render_inhibit |= INHIBIT_BLANK;
+        timer_arm(blank_tfd, 1000, 1000);
+    } else if (!off && (render_inhibit & INHIBIT_BLANK)) {
+        render_resume(INHIBIT_BLANK);
+        blank_idle_rearm();
+    }
+}
+
+static void blank_timer_expired(void) {
+    uint64_t expirations;
+    if (read(blank_tfd, &expirations, sizeof(expirations)) < 0) return;
+    if (render_inhibit & INHIBIT_BLANK) {
+        blank_check();
+    } else if (render_inhibit & INHIBIT_VT) {
+        blank_idle_rearm();
+    } else {
+        blank_set(1);
+    }
+}
+
+static void view_to_bottom(void) {
+    if (sb_count || scroll_px) {
+        sb_count = 0;
+        scroll_px = 0;
+        draw_terminal();
+    }
+}
+
+static void clip_paste(void) {
+    if (!clip.len || paste.buf) return;
+    paste.buf = malloc(clip.len);
+    if (!paste.buf) {
+        fprintf(stderr, "touchvt: paste: out of memory\n");
+        return;
+    }
+    memcpy(paste.buf, clip.buf, clip.len);
+    paste.len = clip.len;
+    paste.off = 0;
+    paste.cr = 0;
+    paste.bracketed = term_modes & MODE_BRACKETED_PASTE;
+    paste.t0 = now_ms();
+    view_to_bottom();
+    if (paste.bracketed)
+        pty_queue("\033[200~", 6);
+}
+
+static void paste_pump(void) {
+    if (!paste.buf || pty_out.len >= PASTE_CHUNK) return;
+    size_t n = paste.len - paste.off, start = pty_out.len;
+    if (n > PASTE_CHUNK) n = PASTE_CHUNK;
+    pty_queue(paste.buf + paste.off, n);
+    if (pty_out.len == start) return;
+    paste.off += n;
+
+    size_t j = start;
+    for (size_t i = start; i < pty_out.len; i++) {
+        char c = pty_out.buf[i];
+        if (c == 0x1b && paste.bracketed) continue;
+        if (c == '\n' && paste.cr) {
+            paste.cr = 0;
+            continue;
+        }
+        paste.cr = c == '\r';
+        pty_out.buf[j++] = c == '\n' ? '\r' : c;
+    }
+    pty_out.len = j;
+
+    if (paste.off < paste.len) return;
+    if (paste.bracketed)
+        pty_queue("\033[201~", 6);
+    paste.last_len = paste.len;
+    paste.last_ms = now_ms() - paste.t0;
+    paste.total += paste.len;
+    free(paste.buf);
+    paste.buf = NULL;
+}
+
+static void key_send(uint32_t ksym, unsigned int mods, uint32_t unicode) {
+    view_to_bottom();
+
+    int had_pred = pred_shown();
+    pred_key(ksym, !(mods & (TSM_CONTROL_MASK | TSM_ALT_MASK)));
+    tsm_vte_handle_keyboard(tsm_vte, ksym, 0, mods, unicode);
+    if (had_pred || pred_shown())
+        term_damaged = 1;
+}
+
+/* Types UTF-8 text straight into the PTY queue, without going through
+ * libtsm's keysym translation. Alt prefixes it with ESC as it would a
+ * Latin-1 key. Local echo only predicts Latin-1, so pending predictions
+ * are dropped rather than left to fail. */
+static void key_text(const char *text, size_t len) {
+    view_to_bottom();
+    if (pred_shown())
+        term_damaged = 1;
+    pred.n = 0;
+    if (alt_on)
+        pty_queue("\033", 1);
+    pty_queue(text, len);
+}
+
+/* Sends a key to the application with the current modifiers. Keys that
+ * type characters past Latin-1 are sent as UTF-8 directly. */
+static void key_emit(uint32_t ksym) {
+    uint32_t u = keysym_unicode(ksym);
+    if (u >= 0x100) {
+        unsigned char buf[4];
+        key_text((const char *)buf, utf8_encode(u, buf));
+        return;
+    }
+
+    unsigned int mods = 0;
+    if (shift_on) mods |= TSM_SHIFT_MASK;
+    if (ctrl_on) mods |= TSM_CONTROL_MASK;
+    if (alt_on) mods |= TSM_ALT_MASK;
+
+    key_send(ksym, mods, (ksym < 0x100) ? ksym : TSM_VTE_INVALID);
+}
+
+/* Returns 1 if the key sent input and may auto-repeat. */
+static int handle_key(int k, int down) {
+    const struct key_info *ki = &kb->keys[k];
+    uint32_t ksym = shift_on ? ki->keysym_shift : ki->keysym;
+
+    if (ki->layer) {
+        if (down) kb_switch(ki->layer - 1);
+        return 0;
+    }
+
+    if (down && ctrl_on) {
+        if (shift_on && ksym == 'F') {
+            shift_on = ctrl_on = 0;
+            search_toggle();
+            return 0;
+        }
+        if (!shift_on && ksym == '-') {
+            resize_layout(current_font_size - 2);
+            return 0;
+        }
+        if (shift_on && ksym == '+') {
+            resize_layout(current_font_size + 2);
+            return 0;
+        }
+        if (shift_on && (ksym == 0xff55 || ksym == 0xff56)) {
+            shift_on = ctrl_on = 0;
+            session_step(ksym == 0xff56 ? 1 : -1);
+            return 0;
+        }
+    }
+
+    if (ksym == 0xffe1 || ksym == 0xffe2) {
+        if (down) shift_on = !shift_on;
+        return 0;
+    }
+    if (ksym == 0xffe3) {
+        if (down) ctrl_on = !ctrl_on;
+        return 0;
+    }
+    if (ksym == 0xffe9) {
+        if (down) alt_on = !alt_on;
+        return 0;
+    }
+    if (!down) return 0;
+
+    fling_stop();
+    if (search.active)
+        return search_key(ksym);
+    if (ksym == 0x1008ff6d) {
+        clip_paste();
+        return 0;
+    }
+    if (ksym == 0x1008ff2c) {
+        osk_set(osk_hidden, 1);
+        return 0;
+    }
+    if (ksym == 0x1008ff26 || ksym == 0x1008ff27) {
+        session_step(ksym == 0x1008ff27 ? 1 : -1);
+        return 0;
+    }
+    const char *text = shift_on ? ki->text_shift : ki->text;
+    if (text) {
+        key_text(text, strlen(text));
+        return 1;
+    }
+    key_emit(ksym);
+    return 1;
+}
+
+/* Hardware keyboards. Keys are translated with xkbcommon, using the layout
+ * from the usual XKB_DEFAULT_* variables, and take the same path as the
+ * on-screen keys. */
+static struct {
+    struct xkb_context *ctx;
+    struct xkb_keymap *keymap;
+    struct xkb_state *state;
+    xkb_mod_index_t shift, ctrl, alt;
+    xkb_keycode_t repeat_key;
+} hw;
+
+static void hw_init(void) {
+    hw.ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (hw.ctx)
+        hw.keymap = xkb_keymap_new_from_names(hw.ctx, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (hw.keymap)
+        hw.state = xkb_state_new(hw.keymap);
+    if (!hw.state) {
+        fprintf(stderr, "touchvt: no xkb keymap, hardware keyboards are ignored\n");
+        return;
+    }
+    hw.shift = xkb_keymap_mod_get_index(hw.keymap, XKB_MOD_NAME_SHIFT);
+    hw.ctrl = xkb_keymap_mod_get_index(hw.keymap, XKB_MOD_NAME_CTRL);
+    hw.alt = xkb_keymap_mod_get_index(hw.keymap, XKB_MOD_NAME_ALT);
+}
+
+static void hw_free(void) {
+    xkb_state_unref(hw.state);
+    xkb_keymap_unref(hw.keymap);
+    xkb_context_unref(hw.ctx);
+}
+
+static int hw_mod(xkb_mod_index_t idx) {
+    return idx != XKB_MOD_INVALID && xkb_state_mod_index_is_active(hw.state, idx, XKB_STATE_MODS_EFFECTIVE) > 0;
+}
+
+/* Returns 1 if the key sent input and may auto-repeat. */
+static int hw_press(xkb_keycode_t code) {
+    xkb_keysym_t sym = xkb_state_key_get_one_sym(hw.state, code);
+    if (sym == XKB_KEY_NoSymbol || (sym >= 0xffe1 && sym <= 0xffee)) return 0;
+
+    unsigned int mods = 0;
+    if (hw_mod(hw.shift)) mods |= TSM_SHIFT_MASK;
+    if (hw_mod(hw.ctrl)) mods |= TSM_CONTROL_MASK;
+    if (hw_mod(hw.alt)) mods |= TSM_ALT_MASK;
+
+    if (mods & TSM_CONTROL_MASK) {
+        if ((mods & TSM_SHIFT_MASK) && (sym == 'F' || sym == 'f')) {
+            search_toggle();
+            return 0;
+        }
+        if (sym == '-') {
+            resize_layout(current_font_size - 2);
+            return 0;
+        }
+        if (sym == '+' || sym == '=') {
+            resize_layout(current_font_size + 2);
+            return 0;
+        }
+        if ((mods & TSM_SHIFT_MASK) && (sym == 0xff55 || sym == 0xff56)) {
+            session_step(sym == 0xff56 ? 1 : -1);
+            return 0;
+        }
+    }
+
+    fling_stop();
+    if (search.active)
+        return search_key(sym);
+    if ((mods & TSM_SHIFT_MASK) && sym == 0xff63) {
+        clip_paste();
+        return 0;
+    }
+    uint32_t unicode = xkb_keysym_to_utf32(sym);
+    key_send(sym, mods, unicode ? unicode : TSM_VTE_INVALID);
+    return xkb_keymap_key_repeats(hw.keymap, code);
+}
+
+/* Key auto-repeat. Expirations that piled up since the last loop iteration
+ * are replayed together, so they end up in one PTY write and one render. */
+static int repeat_tfd = -1;
+
+static void repeat_start(void) {
+    if (repeat_rate > 0 && repeat_rate <= 1000)
+        timer_arm(repeat_tfd, repeat_delay > 0 ? repeat_delay : 1, 1000 / repeat_rate);
+}
+
+static void repeat_stop(void) {
+    hw.repeat_key = 0;
+    timer_arm(repeat_tfd, 0, 0);
+}
+
+static void repeat_tick(void) {
+    uint64_t expirations;
+    if (read(repeat_tfd, &expirations, sizeof(expirations)) < 0) return;
+    if (expirations > 64) expirations = 64;
+    if (hw.repeat_key) {
+        while (expirations--)
+            if (!hw_press(hw.repeat_key)) {
+                repeat_stop();
+                break;
+            }
+        return;
+    }
+    if (pressed_key < 0) {
+        repeat_stop();
+        return;
+    }
+    while (expirations--)
+        if (!handle_key(pressed_key, 1)) {
+            repeat_stop();
+            break;
+        }
+}
+
+/* Only devices with letter keys count as keyboards; power and volume
+ * buttons are keyboard devices too. */
+static int hw_full_keyboard(struct libinput_device *dev) {
+    return libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_KEYBOARD) &&
+           libinput_device_keyboard_has_key(dev, KEY_A) > 0;
+}
+
+static int hw_keyboards;
+
+static void hw_device(struct libinput_device *dev, int added) {
+    if (!hw_full_keyboard(dev)) return;
+    hw_keyboards += added ? 1 : -1;
+    if (hw_keyboards <= 0) {
+        hw_keyboards = 0;
+        osk_set(0, osk_collapsed);
+    }
+}
+
+/* Key state is tracked even while the VT is away so modifiers released
+ * meanwhile do not stick. */
+static void hw_key(struct libinput_event *ev) {
+    if (!hw.state) return;
+    struct libinput_event_keyboard *ke = libinput_event_get_keyboard_event(ev);
+    xkb_keycode_t code = libinput_event_keyboard_get_key(ke) + 8;
+    int down = libinput_event_keyboard_get_key_state(ke) == LIBINPUT_KEY_STATE_PRESSED;
+    xkb_state_update_key(hw.state, code, down ? XKB_KEY_DOWN : XKB_KEY_UP);
+
+    if (!down) {
+        if (code == hw.repeat_key)
+            repeat_stop();
+        return;
+    }
+    if (render_inhibit & INHIBIT_VT) return;
+    if (blanked_by_us) {
+        blank_set(0);
+        return;
+    }
+    if (osk_mode == OSK_AUTO && hw_full_keyboard(libinput_event_get_device(ev)))
+        osk_set(1, osk_collapsed);
+    repeat_stop();
+    if (hw_press(code)) {
+        hw.repeat_key = code;
+        repeat_start();
+    }
+}
+
+/* The cell under a touch in the terminal area, as a line number and
+ * column. */
+static void sel_cell(int tx, int ty, uint64_t *line, int *col) {
+    int v = (ty - scroll_px + cell_h) / cell_h - 1;
+    if (v >= term_rows) v = term_rows - 1;
+    if (v < -1) v = -1;
+    if (v - sb_count < -(int)sb.nlines) v = sb_count - sb.nlines;
+    *line = sb.pushed - sb_count + v;
+    *col = tx / cell_w;
+    if (*col >= term_cols) *col = term_cols - 1;
+}
+
+/* A touch in the terminal area that stays put for LONG_PRESS_MS starts a
+ * selection instead of a scroll drag. */
+static void sel_press(int tx, int ty) {
+    if (sel.active) {
+        sel.active = 0;
+        term_damaged = 1;
+    }
+    sel.pending = 1;
+    sel.x = tx;
+    sel.y = ty;
+    timer_arm(press_tfd, LONG_PRESS_MS, 0);
+}
+
+static void sel_apply(void) {
+    if (!sel.dragging) return;
+    uint64_t line;
+    int col;
+    sel_cell(sel.x, sel.y, &line, &col);
+    if (line == sel.l1 && col == sel.c1) return;
+    sel.l1 = line;
+    sel.c1 = col;
+    term_damaged = 1;
+}
+
+static void sel_release(void) {
+    sel.pending = 0;
+    if (!sel.dragging) return;
+    sel_apply();
+    sel.dragging = 0;
+    sel_copy();
+}
+
+static const char *key_alts(int k) {
+    const struct key_info *ki = &kb->keys[k];
+    const char *alts = shift_on ? ki->alts_shift : ki->alts;
+    if (alts || ki->text || ki->layer || ctrl_on || alt_on) return alts;
+    uint32_t ksym = shift_on ? ki->keysym_shift : ki->keysym;
+    for (size_t i = 0; i < sizeof(default_alts) / sizeof(default_alts[0]); i++)
+        if (default_alts[i].keysym == ksym) return default_alts[i].alts;
+    return NULL;
+}
 
-    for (int r = 0; r < ROWS; r++) {
-        for (int col = 0; col < COLS; col++) {
-            int kx = col * kw, ky = kb_y + r * kh;
-            int cur_w = kw;
+/* A key with alternates types on release instead of on press, so a long
+ * press can open the popup instead. Returns 1 if the key was held back. */
+static int popup_press(int k) {
+    if (!(popup.alts = key_alts(k))) return 0;
+    popup.armed = 1;
+    popup.key = k;
+    timer_arm(press_tfd, LONG_PRESS_MS, 0);
+    return 1;
+}
 
-            if (r == 4 && col == 5) {
-                cur_w = kw * 2;
-            } else if (r == 4 && col == 6) {
-                continue;
-            }
+static void popup_cell(int i) {
+    int x = popup.x + i * popup.cw;
+    fill_rect(x + 1, popup.y + 1, popup.cw - 2, popup.h - 2, i == popup.sel ? 0xff404080 : 0xff303030);
+    draw_label(popup.alt[i], popup.alt_len[i], text_width_n(popup.alt[i], popup.alt_len[i]), x, popup.y, popup.cw);
+}
 
-            const struct key_info *ki = &keyboard_layout[r][col];
-            uint32_t ksym = shift_on ? ki->keysym_shift : ki->keysym;
+/* If the popup cannot be shown the press stays armed, so releasing the key
+ * still types it. */
+static void popup_show(void) {
+    popup.n = 0;
+    for (const char *p = popup.alts; *p && popup.n < POPUP_MAX;) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        popup.alt[popup.n] = p;
+        while (*p && *p != ' ') p++;
+        popup.alt_len[popup.n] = p - popup.alt[popup.n];
+        popup.n++;
+    }
+    if (!popup.n || render_inhibit) return;
 
-            int is_pressed = (r == pressed_row && col == pressed_col);
-            int is_mod = (ksym == 0xffe1 || ksym == 0xffe2 || ksym == 0xffe3 || ksym == 0xffe9);
-            int is_active = (is_mod && ((ksym == 0xffe1 || ksym == 0xffe2) ? shift_on : (ksym == 0xffe3 ? ctrl_on : alt_on)));
+    const struct key_info *ki = &kb->keys[popup.key];
+    popup.cw = popup.n * kw > fb_w ? fb_w / popup.n : kw;
+    popup.w = popup.n * popup.cw;
+    popup.h = kh;
+    popup.x = ki->x + ki->w / 2 - popup.w / 2;
+    if (popup.x + popup.w > fb_w) popup.x = fb_w - popup.w;
+    if (popup.x < 0) popup.x = 0;
+    popup.y = kb_y + ki->row * kh - kh;
+    if (popup.y < 0) popup.y = 0;
 
-            uint32_t bg = is_pressed ? 0xff404040 : (is_active ? 0xff303060 : 0xff000000);
+    size_t row = (size_t)popup.w * pix->bpp, size = row * popup.h;
+    if (size > popup.under_cap) {
+        uint8_t *u = realloc(popup.under, size);
+        if (!u) return;
+        popup.under = u;
+        popup.under_cap = size;
+    }
+    for (int j = 0; j < popup.h; j++)
+        memcpy(popup.under + j * row, fb_draw + (size_t)(popup.y + j) * fb_stride + popup.x * pix->bpp, row);
 
-            fill_rect(kx + 1, ky + 1, cur_w - 2, kh - 2, bg);
+    popup.armed = 0;
+    popup.shown = 1;
+    popup.sel = 0;
+    fill_rect(popup.x, popup.y, popup.w, popup.h, 0xff000000);
+    for (int i = 0; i < popup.n; i++)
+        popup_cell(i);
+}
 
-            const char *txt = shift_on ? ki->label_shift : ki->label;
-            int tw = shift_on ? ki->label_shift_w : ki->label_w;
-            int tx = kx + (cur_w - tw) / 2;
-            int ty = ky + kh / 2;
-            int baseline = ty + baseline_offset;
-            uint32_t c = 0xffffffff;
+/* Follows the finger, redrawing only the two cells whose highlight
+ * changed. */
+static void popup_apply(void) {
+    if (!popup.shown) return;
+    int sel = (popup.finger_x - popup.x) / popup.cw;
+    if (sel < 0) sel = 0;
+    if (sel >= popup.n) sel = popup.n - 1;
+    if (sel == popup.sel) return;
+    int old = popup.sel;
+    popup.sel = sel;
+    popup_cell(old);
+    popup_cell(sel);
+}
 
-            int x_cursor = tx;
-            for (const char *p = txt; *p; p++) {
-                int gw, gh, xoff, yoff;
-                unsigned char *bmp = stbtt_GetCodepointBitmap(&font, font_scale, font_scale,
-                                                              *p, &gw, &gh, &xoff, &yoff);
-                if (bmp) {
-                    draw_bitmap(x_cursor + xoff, baseline + yoff, bmp, gw, gh, c);
-                    stbtt_FreeBitmap(bmp, NULL);
-                }
-                int advance, lsb;
-                stbtt_GetCodepointHMetrics(&font, *p, &advance, &lsb);
-                x_cursor += (int)(advance * font_scale);
-            }
-        }
+/* A tap types the key itself; otherwise the popup is taken down by putting
+ * back what it covered and the chosen alternate is typed. */
+static void popup_release(void) {
+    timer_arm(press_tfd, 0, 0);
+    if (popup.armed) {
+        popup.armed = 0;
+        handle_key(popup.key, 1);
+        return;
     }
+    if (!popup.shown) return;
+    popup_apply();
+    popup.shown = 0;
+    size_t row = (size_t)popup.w * pix->bpp;
+    for (int j = 0; j < popup.h; j++)
+        memcpy(fb_draw + (size_t)(popup.y + j) * fb_stride + popup.x * pix->bpp, popup.under + j * row, row);
+    mark_dirty(popup.y, popup.h);
+    key_text(popup.alt[popup.sel], popup.alt_len[popup.sel]);
 }
 
-static void draw_glyph(int px, int py, uint32_t ch, uint32_t fg, uint32_t bg, unsigned int width) {
-    int total_w = width * cell_w;
+static void long_press_fired(void) {
+    uint64_t expirations;
+    if (read(press_tfd, &expirations, sizeof(expirations)) < 0) return;
+    if (popup.armed) {
+        popup_show();
+    } else if (pad.armed) {
+        pad.armed = 0;
+        pad.active = 1;
+        pad.x0 = pad.x;
+        pad.y0 = pad.y;
+        draw_key(pressed_key);
+    } else if (sel.pending) {
+        sel.pending = 0;
+        sel.dragging = sel.active = 1;
+        last_touch_y = -1;
+        scroll_snap();
+        sel_cell(sel.x, sel.y, &sel.l0, &sel.c0);
+        sel.l1 = sel.l0;
+        sel.c1 = sel.c0;
+        term_damaged = 1;
+    }
+}
 
-    fill_rect(px, py, total_w, cell_h, bg);
+static void pad_press(int tx, int ty) {
+    pad.armed = 1;
+    pad.x0 = pad.x = tx;
+    pad.y0 = pad.y = ty;
+    timer_arm(press_tfd, LONG_PRESS_MS, 0);
+}
 
-    if (ch == 0 || ch == ' ')
-        return;
+/* Converts the finger travel since the last call into arrow keys. They are
+ * queued for the PTY and written with everything else this iteration. */
+static void pad_apply(void) {
+    if (!pad.active) return;
+    int sx = (pad.x - pad.x0) / cell_w, sy = (pad.y - pad.y0) / cell_h;
+    pad.x0 += sx * cell_w;
+    pad.y0 += sy * cell_h;
+    for (; sx > 0; sx--) key_emit(0xff53);
+    for (; sx < 0; sx++) key_emit(0xff51);
+    for (; sy > 0; sy--) key_emit(0xff54);
+    for (; sy < 0; sy++) key_emit(0xff52);
+}
 
-    int w, h, xoff, yoff;
-    unsigned char *bmp = glyph_cache_get(ch, &w, &h, &xoff, &yoff);
-    if (!bmp) return;
+/* Ends the gesture; a plain tap still types a space. */
+static void pad_release(void) {
+    timer_arm(press_tfd, 0, 0);
+    if (pad.armed)
+        handle_key(pressed_key, 1);
+    pad.armed = pad.active = 0;
+}
 
-    int ascent, descent, linegap;
-    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
-    int baseline = py + (int)(ascent * font_scale);
+/* Touches in the terminal area become left button events while the
+ * application has mouse reporting on. Motion is reported at most once per
+ * input batch, and only when the finger reaches another cell. */
+static int mouse_active(void) {
+    return (term_modes & MODE_MOUSE_ANY) && !sb_count && !search.active;
+}
 
-    draw_bitmap(px + xoff, baseline + yoff, bmp, w, h, fg);
-    if (ch >= GLYPH_CACHE_SIZE)
-        stbtt_FreeBitmap(bmp, NULL);
+static void mouse_report(int button, int col, int row, int release) {
+    char buf[64];
+    int n, mods = 0;
+    if (!(term_modes & MODE_MOUSE_X10)) {
+        if (shift_on) mods |= 4;
+        if (alt_on) mods |= 8;
+        if (ctrl_on) mods |= 16;
+    }
+    if (term_modes & MODE_MOUSE_SGR) {
+        n = snprintf(buf, sizeof(buf), "\033[<%d;%d;%d%c", button | mods, col + 1, row + 1,
+                     release ? 'm' : 'M');
+    } else {
+        if (col > 222 || row > 222) return;
+        n = snprintf(buf, sizeof(buf), "\033[M%c%c%c", 32 + ((release ? 3 : button) | mods),
+                     33 + col, 33 + row);
+    }
+    pty_queue(buf, n);
 }
 
-static int term_draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
-                        size_t len, unsigned int width, unsigned int posx,
-                        unsigned int posy, const struct tsm_screen_attr *attr,
-                        tsm_age_t age, void *data) {
-    (void)con; (void)id; (void)age; (void)data;
+static void mouse_cell(int tx, int ty, int *col, int *row) {
+    *col = tx / cell_w;
+    *row = ty / cell_h;
+    if (*col >= term_cols) *col = term_cols - 1;
+    if (*row >= term_rows) *row = term_rows - 1;
+    if (*col < 0) *col = 0;
+    if (*row < 0) *row = 0;
+}
 
-    uint32_t fg = 0xff000000 | (attr->fr << 16) | (attr->fg << 8) | attr->fb;
-    uint32_t bg = 0xff000000 | (attr->br << 16) | (attr->bg << 8) | attr->bb;
+static void mouse_press(int tx, int ty) {
+    mouse.down = 1;
+    mouse.x = tx;
+    mouse.y = ty;
+    mouse_cell(tx, ty, &mouse.col, &mouse.row);
+    mouse_report(0, mouse.col, mouse.row, 0);
+}
 
-    if (attr->inverse) {
-        uint32_t tmp = fg;
-        fg = bg;
-        bg = tmp;
-    }
+static void mouse_apply(void) {
+    if (!mouse.down || !(term_modes & (MODE_MOUSE_DRAG | MODE_MOUSE_MOTION))) return;
+    int col, row;
+    mouse_cell(mouse.x, mouse.y, &col, &row);
+    if (col == mouse.col && row == mouse.row) return;
+    mouse.col = col;
+    mouse.row = row;
+    mouse_report(32, col, row, 0);
+}
 
-    uint32_t c = (len > 0) ? ch[0] : ' ';
-    int px = posx * cell_w;
-    int py = posy * cell_h;
-
-    draw_glyph(px, py, c, fg, bg, width);
-
-    unsigned int cx = tsm_screen_get_cursor_x(tsm_screen);
-    unsigned int cy = tsm_screen_get_cursor_y(tsm_screen);
-    if (posx == cx && posy == cy && !sb_count) {
-        for (int j = 0; j < cell_h; j++) {
-            int screen_y = py + j;
-            if (screen_y >= term_height) break;
-            if (screen_y < 0) continue;
-            uint32_t *dst = fb_mem + screen_y * fb_stride_pixels;
-            for (int i = 0; i < cell_w; i++) {
-                int tx = px + i;
-                if (tx >= 0 && tx < fb_w) {
-                    dst[tx] = (dst[tx] & 0xff000000) ^ 0x00ffffff;
-                }
-            }
-        }
-    }
-    return 0;
+static void mouse_release(void) {
+    mouse_apply();
+    mouse.down = 0;
+    if (!(term_modes & MODE_MOUSE_X10))
+        mouse_report(0, mouse.col, mouse.row, 1);
 }
 
-static void draw_terminal(void) {
-    tsm_screen_draw(tsm_screen, term_draw_cb, NULL);
+static void alt_press(int tx, int ty, int wheel) {
+    alt.active = 1;
+    alt.wheel = wheel;
+    alt.moved = 0;
+    alt.x = tx;
+    alt.y = alt.y0 = alt.ay = ty;
+    alt.tokens = ALT_SCROLL_BURST;
+    alt.t = now_ms();
 }
 
-static void resize_layout(int size) {
-    if (size < 8) size = 8;
-    if (size > 64) size = 64;
-    current_font_size = size;
+/* Sends one step per cell_h of travel, limited to ALT_SCROLL_RATE steps per
+ * second after an initial burst. Travel beyond the limit is dropped rather
+ * than queued, so the application stops when the finger does. */
+static void alt_apply(void) {
+    if (!alt.active) return;
+    if (!alt.moved && abs(alt.y - alt.y0) < cell_h / 2) return;
+    alt.moved = 1;
 
-    glyph_cache_clear();
-    font_scale = stbtt_ScaleForPixelHeight(&font, current_font_size);
+    int steps = (alt.y - alt.ay) / cell_h;
+    if (!steps) return;
+    alt.ay += steps * cell_h;
 
-    int ascent, descent, linegap;
-    stbtt_GetFontVMetrics(&font, &ascent, &descent, &linegap);
-    cell_h = (int)((ascent - descent + linegap) * font_scale) + 2;
+    double now = now_ms();
+    alt.tokens += (now - alt.t) * ALT_SCROLL_RATE / 1000;
+    if (alt.tokens > ALT_SCROLL_BURST) alt.tokens = ALT_SCROLL_BURST;
+    alt.t = now;
 
-    int advance, lsb;
-    stbtt_GetCodepointHMetrics(&font, 'M', &advance, &lsb);
-    cell_w = (int)(advance * font_scale);
+    int n = abs(steps);
+    if (n > (int)alt.tokens) n = (int)alt.tokens;
+    alt.tokens -= n;
 
-    kh = (int)(2.6 * current_font_size);
-    kw = fb_w / COLS;
-    kb_height = ROWS * kh;
-    kb_y = fb_h - kb_height;
+    int col, row;
+    mouse_cell(alt.x, alt.y, &col, &row);
+    while (n--) {
+        if (alt.wheel)
+            mouse_report(steps > 0 ? 64 : 65, col, row, 0);
+        else
+            key_emit(steps > 0 ? 0xff52 : 0xff54);
+    }
+}
 
-    for (int r = 0; r < ROWS; r++) {
-        for (int c = 0; c < COLS; c++) {
-            keyboard_layout[r][c].label_w = text_width(keyboard_layout[r][c].label);
-            keyboard_layout[r][c].label_shift_w = text_width(keyboard_layout[r][c].label_shift);
-        }
+/* A touch that never moved is still a click in wheel mode. */
+static void alt_release(void) {
+    alt_apply();
+    alt.active = 0;
+    if (alt.wheel && !alt.moved) {
+        int col, row;
+        mouse_cell(alt.x, alt.y0, &col, &row);
+        mouse_report(0, col, row, 0);
+        if (!(term_modes & MODE_MOUSE_X10))
+            mouse_report(0, col, row, 1);
     }
+}
 
-    term_height = kb_y;
-    term_cols = fb_w / cell_w;
-    term_rows = term_height / cell_h;
+static int get_key_at(int tx, int ty) {
+    if (osk_hidden || osk_collapsed || ty < kb_y || ty >= kb_y + kb_rows * kh || tx < 0 || tx >= fb_w)
+        return -1;
+    int k = kb->hit[(ty - kb_y) / kh * fb_w + tx];
+    return k == 0xffff ? -1 : k;
+}
+
+static void vt_restore(void) {
+    if (vt_fd < 0) return;
+    struct vt_mode vtm = {.mode = VT_AUTO};
+    ioctl(vt_fd, VT_SETMODE, &vtm);
+    ioctl(vt_fd, KDSETMODE, KD_TEXT);
+    close(vt_fd);
+    vt_fd = -1;
+}
+
+static void dump_stats(void) {
+    size_t used = 0;
+    for (size_t i = 0; i < sb.nblocks; i++)
+        used += sb.blocks[(sb.block_head + i) % sb.block_cap].used;
+    size_t index = (size_t)(sb_max > 0 ? sb_max : 0) * sizeof(struct sb_line);
+    size_t ram = sb.ram_blocks * SB_BLOCK_SIZE + index;
+    size_t per_k = sb.nlines ? used * 1000 / sb.nlines : 0;
+    size_t ram_per_k = sb.nlines ? ram * 1000 / sb.nlines : 0;
+    fprintf(stderr, "touchvt: scrollback %zu/%d lines, %zu bytes/1000 lines encoded, "
+            "%zu bytes/1000 lines resident\n", sb.nlines, sb_max, per_k, ram_per_k);
+    fprintf(stderr, "touchvt: scrollback ram %zu KiB of %zu KiB budget (%zu blocks + %zu KiB index), "
+            "spill %zu KiB\n", ram / 1024, sb.ram_budget / 1024, sb.ram_blocks, index / 1024,
+            (sb.nblocks - sb.ram_blocks) * (SB_BLOCK_SIZE / 1024));
+    if (lc.misses)
+        fprintf(stderr, "touchvt: line cache %d/%d rows, %zu KiB of %zu KiB, hit ratio %.1f%% (%llu/%llu)\n",
+                lc.used, lc.n, lc.used * lc.row_bytes / 1024, lc.budget / 1024,
+                100.0 * lc.hits / (lc.hits + lc.misses), (unsigned long long)lc.hits,
+                (unsigned long long)(lc.hits + lc.misses));
+    if (pred.confirmed || pred.failed)
+        fprintf(stderr, "touchvt: local echo %lu confirmed, %lu failed, echo delay %.1f ms%s\n",
+                pred.confirmed, pred.failed, pred.srtt, pred.suspended ? ", suspended" : "");
+    if (paste.last_len)
+        fprintf(stderr, "touchvt: paste %zu KiB in %.1f ms (%.2f MiB/s), %llu KiB total%s\n",
+                paste.last_len / 1024, paste.last_ms,
+                paste.last_ms > 0 ? paste.last_len / 1048.576 / paste.last_ms : 0.0,
+                (unsigned long long)(paste.total / 1024), paste.buf ? ", one in progress" : "");
+    if (sync_out.updates)
+        fprintf(stderr, "touchvt: synchronized output %lu updates, %lu frames deferred, %lu timed out\n",
+                sync_out.updates, sync_out.deferred, sync_out.timeouts);
+    if (search.last_lines)
+        fprintf(stderr, "touchvt: last search %zu lines in %.3f ms\n", search.last_lines, search.last_ms);
+    if (nsessions > 1)
+        fprintf(stderr, "touchvt: session %d of %d shown\n", cur_session + 1, nsessions);
+}
 
-    if (tsm_screen) {
-        tsm_screen_resize(tsm_screen, term_cols, term_rows);
-        struct winsize ws = {.ws_row = term_rows,
-            .ws_col = term_cols,
-            .ws_xpixel = term_cols * cell_w,
-            .ws_ypixel = term_rows * cell_h};
-        ioctl(pty_master, TIOCSWINSZ, &ws);
+static double bench_repaint(uint8_t *target, int shadowed, int frames) {
+    uint8_t *saved_mem = fb_mem, *saved_draw = fb_draw;
+    fb_mem = target;
+    fb_draw = shadowed ? fb_shadow : target;
+
+    double t0 = now_ms();
+    for (int i = 0; i < frames; i++) {
         fill_rect(0, 0, fb_w, fb_h, 0xff000000);
         draw_keyboard();
         draw_terminal();
+        fb_flush();
     }
-}
+    double t = (now_ms() - t0) / frames;
 
-static void handle_key(int r, int c, int down) {
-    const struct key_info *ki = &keyboard_layout[r][c];
-    uint32_t ksym = shift_on ? ki->keysym_shift : ki->keysym;
+    fb_mem = saved_mem;
+    fb_draw = saved_draw;
+    return t;
+}
 
-    if (down && ctrl_on) {
-        if (!shift_on && ksym == '-') {
-            resize_layout(current_font_size - 2);
-            return;
-        }
-        if (shift_on && ksym == '+') {
-            resize_layout(current_font_size + 2);
-            return;
-        }
+static void run_bench(int frames) {
+    static const char *sgr[] = {"0", "1;31", "32", "1;33", "34", "35", "36", "7"};
+    char line[512];
+    for (int r = 0; r < term_rows; r++) {
+        int n = snprintf(line, sizeof(line), "\r\n\033[%sm", sgr[r % 8]);
+        for (int c = 0; c < term_cols - 1 && n < (int)sizeof(line) - 8; c++)
+            line[n++] = '!' + (r * 7 + c) % 94;
+        n += snprintf(line + n, sizeof(line) - n, "\033[0m");
+        term_input(line, n);
     }
 
-    if (ksym == 0xffe1 || ksym == 0xffe2) {
-        if (down) shift_on = !shift_on;
-        return;
-    }
-    if (ksym == 0xffe3) {
-        if (down) ctrl_on = !ctrl_on;
-        return;
-    }
-    if (ksym == 0xffe9) {
-        if (down) alt_on = !alt_on;
+    size_t fb_size = (size_t)fb_h * fb_stride;
+    uint8_t *offscreen = aligned_alloc(64, (fb_size + 63) & ~(size_t)63);
+    if (!offscreen || !fb_shadow) {
+        fprintf(stderr, "touchvt: bench: out of memory\n");
+        free(offscreen);
         return;
     }
-    if (!down) return;
-
-    tsm_screen_sb_reset(tsm_screen);
-    sb_count = 0;
-
-    unsigned int mods = 0;
-    if (shift_on) mods |= TSM_SHIFT_MASK;
-    if (ctrl_on) mods |= TSM_CONTROL_MASK;
-    if (alt_on) mods |= TSM_ALT_MASK;
-
-    uint32_t unicode = (ksym < 0x100) ? ksym : TSM_VTE_INVALID;
-    tsm_vte_handle_keyboard(tsm_vte, ksym, 0, mods, unicode);
-}
+    memset(offscreen, 0, fb_size);
 
-static int get_key_at(int tx, int ty, int *row, int *col) {
-    if (ty < kb_y || ty >= kb_y + ROWS * kh)
-        return 0;
-    *col = tx / kw;
-    *row = (ty - kb_y) / kh;
-    if (*col >= COLS) *col = COLS - 1;
-    if (*row == 4 && *col == 6) *col = 5;
-    return 1;
+    printf("touchvt bench: %dx%d %s, %d frames of full repaint\n", fb_w, fb_h, pix->name, frames);
+    printf("  offscreen  scattered %7.3f ms/frame  streamed %7.3f ms/frame\n",
+           bench_repaint(offscreen, 0, frames), bench_repaint(offscreen, 1, frames));
+    printf("  /dev/fb0   scattered %7.3f ms/frame  streamed %7.3f ms/frame\n",
+           bench_repaint(fb_mem, 0, frames), bench_repaint(fb_mem, 1, frames));
+    free(offscreen);
 }
 
 int main(int argc, char **argv) {
@@ -434,6 +3865,9 @@ int main(int argc, char **argv) {
     signal(SIGHUP, SIG_IGN);
     signal(SIGCHLD, sigchld_handler);
     signal(SIGUSR1, sigusr1_handler);
+    signal(SIGUSR2, sigusr2_handler);
+    signal(SIGRTMIN, vt_release_handler);
+    signal(SIGRTMIN + 1, vt_acquire_handler);
 
     fb_fd = open("/dev/fb0", O_RDWR);
     if (fb_fd < 0) {
@@ -444,8 +3878,10 @@ int main(int argc, char **argv) {
     ioctl(fb_fd, FBIOGET_FSCREENINFO, &finfo);
     fb_w = vinfo.xres;
     fb_h = vinfo.yres;
+    clip_y1 = fb_h;
     fb_stride = finfo.line_length;
-    fb_stride_pixels = fb_stride / 4;
+    if (pixfmt_select() < 0)
+        return 1;
 
     size_t fb_size = fb_h * fb_stride;
     fb_mem = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
@@ -453,6 +3889,10 @@ int main(int argc, char **argv) {
         perror("touchvt: mmap");
         return 1;
     }
+    fb_shadow = aligned_alloc(64, (fb_size + 63) & ~(size_t)63);
+    if (fb_shadow)
+        memset(fb_shadow, 0, fb_size);
+    fb_draw = fb_shadow ? fb_shadow : fb_mem;
 
     vinfo.xoffset = 0;
     vinfo.yoffset = 0;
@@ -460,6 +3900,8 @@ int main(int argc, char **argv) {
 
     font_data = font_ttf;
     int cmd_start_index = argc;
+    int bench_frames = 0;
+    int want_sessions = 1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--font") == 0) {
@@ -476,6 +3918,126 @@ int main(int argc, char **argv) {
             }
             continue;
         }
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench_frames = 200;
+            continue;
+        }
+        if (strcmp(argv[i], "--scrollback") == 0) {
+            if (i + 1 < argc) {
+                sb_max = atoi(argv[i + 1]);
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--scrollback-ram") == 0) {
+            if (i + 1 < argc) {
+                sb.ram_budget = (size_t)atol(argv[i + 1]) * 1024;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--repeat-delay") == 0) {
+            if (i + 1 < argc) {
+                repeat_delay = atoi(argv[i + 1]);
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--repeat-rate") == 0) {
+            if (i + 1 < argc) {
+                repeat_rate = atoi(argv[i + 1]);
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--layout") == 0) {
+            if (i + 1 < argc) {
+                if (kb_load(argv[i + 1]) < 0)
+                    return 1;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--osk") == 0) {
+            if (i + 1 < argc) {
+                osk_mode = strcmp(argv[i + 1], "always") == 0 ? OSK_ALWAYS : OSK_AUTO;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--alt-scroll") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "off") == 0)
+                    alt_scroll = ALT_SCROLL_OFF;
+                else if (strcmp(argv[i + 1], "wheel") == 0)
+                    alt_scroll = ALT_SCROLL_WHEEL;
+                else
+                    alt_scroll = ALT_SCROLL_ARROWS;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--osc52") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "off") == 0)
+                    osc52_mode = OSC52_OFF;
+                else if (strcmp(argv[i + 1], "rw") == 0)
+                    osc52_mode = OSC52_RW;
+                else
+                    osc52_mode = OSC52_WRITE;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--osc52-max") == 0) {
+            if (i + 1 < argc) {
+                osc52_max = (size_t)atol(argv[i + 1]) * 1024;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--predict") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "never") == 0)
+                    pred.mode = PRED_NEVER;
+                else if (strcmp(argv[i + 1], "always") == 0)
+                    pred.mode = PRED_ALWAYS;
+                else
+                    pred.mode = PRED_AUTO;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--line-cache") == 0) {
+            if (i + 1 < argc) {
+                lc.budget = (size_t)atol(argv[i + 1]) * 1024;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--scrollback-spill") == 0) {
+            if (i + 1 < argc) {
+                sb_spill_dir = argv[i + 1];
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--sessions") == 0) {
+            if (i + 1 < argc) {
+                want_sessions = atoi(argv[i + 1]);
+                if (want_sessions < 1) want_sessions = 1;
+                if (want_sessions > MAX_SESSIONS) want_sessions = MAX_SESSIONS;
+                i++;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--blank-timeout") == 0) {
+            if (i + 1 < argc) {
+                blank_timeout = atoi(argv[i + 1]);
+                i++;
+            }
+            continue;
+        }
         if (strcmp(argv[i], "--vt") == 0) {
             if (i + 1 < argc) {
                 int vt_num = 0;
@@ -484,12 +4046,16 @@ int main(int argc, char **argv) {
                     active_vt = vt_num;
                     char tty_path[32];
                     snprintf(tty_path, sizeof(tty_path), "/dev/tty%d", vt_num);
-                    int vt_fd = open(tty_path, O_RDWR | O_NOCTTY);
+                    vt_fd = open(tty_path, O_RDWR | O_NOCTTY);
                     if (vt_fd >= 0) {
                         ioctl(vt_fd, VT_ACTIVATE, vt_num);
                         ioctl(vt_fd, VT_WAITACTIVE, vt_num);
                         ioctl(vt_fd, KDSETMODE, KD_GRAPHICS);
-                        close(vt_fd);
+                        struct vt_mode vtm = {.mode = VT_PROCESS,
+                            .relsig = SIGRTMIN,
+                            .acqsig = SIGRTMIN + 1};
+                        if (ioctl(vt_fd, VT_SETMODE, &vtm) < 0)
+                            perror("touchvt: VT_SETMODE");
                     }
                 }
                 i++;
@@ -505,48 +4071,30 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (tsm_screen_new(&tsm_screen, NULL, NULL) < 0) {
-        fprintf(stderr, "touchvt: tsm_screen_new failed\n");
-        return 1;
-    }
-    tsm_screen_set_max_sb(tsm_screen, 1000);
-
-    if (tsm_vte_new(&tsm_vte, tsm_screen, vte_write_cb, NULL, NULL, NULL) < 0) {
-        fprintf(stderr, "touchvt: tsm_vte_new failed\n");
+    /* --scrollback-ram is the budget for all sessions together. */
+    sb.ram_budget /= want_sessions;
+    if (session_new() < 0)
         return 1;
-    }
 
     resize_layout(20);
 
-    struct winsize ws = {.ws_row = term_rows,
-        .ws_col = term_cols,
-        .ws_xpixel = term_cols * cell_w,
-        .ws_ypixel = term_rows * cell_h};
-    child_pid = forkpty(&pty_master, NULL, NULL, &ws);
-    if (child_pid < 0) {
-        perror("touchvt: forkpty");
-        return 1;
-    }
-    if (child_pid == 0) {
-        setenv("TERM", "xterm-256color", 1);
-        if (active_vt != -1) {
-            char vtnr[16];
-            snprintf(vtnr, sizeof(vtnr), "%d", active_vt);
-            setenv("XDG_VTNR", vtnr, 1);
-        }
-        setenv("XDG_SESSION_TYPE", "tty", 1);
-        setenv("XDG_SEAT", "seat0", 1);
-        if (cmd_start_index < argc) {
-            execvp(argv[cmd_start_index], &argv[cmd_start_index]);
-            perror("touchvt: execvp");
-            _exit(127);
-        }
-        char *shell = getenv("SHELL");
-        if (!shell) shell = "/bin/sh";
-        execlp(shell, shell, NULL);
-        _exit(127);
+    if (bench_frames) {
+        run_bench(bench_frames);
+        tsm_vte_unref(tsm_vte);
+        tsm_screen_unref(tsm_screen);
+        glyph_cache_clear();
+        vt_restore();
+        free(fb_shadow);
+        munmap(fb_mem, fb_size);
+        close(fb_fd);
+        return 0;
     }
-    fcntl(pty_master, F_SETFL, O_NONBLOCK);
+
+    if (session_spawn(cmd_start_index < argc ? &argv[cmd_start_index] : NULL) < 0)
+        return 1;
+    while (nsessions < want_sessions)
+        if (session_add() < 0)
+            return 1;
 
     struct udev *udev = udev_new();
     struct libinput *li = libinput_udev_create_context(
@@ -554,22 +4102,68 @@ int main(int argc, char **argv) {
             .open_restricted = (int (*)(const char *, int, void *))open,
             .close_restricted = (void (*)(int, void *))(void (*)(void))close},
         NULL, udev);
+    hw_init();
     libinput_udev_assign_seat(li, "seat0");
     int li_fd = libinput_get_fd(li);
 
     draw_keyboard();
     draw_terminal();
 
-    struct pollfd pfds[2] = {
-        {.fd = li_fd, .events = POLLIN},
-        {.fd = pty_master, .events = POLLIN}
+    backlight_open();
+    blank_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    fling_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    repeat_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    press_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (blank_timeout > 0)
+        blank_idle_rearm();
+
+    enum { PFD_INPUT, PFD_BLANK, PFD_FLING, PFD_REPEAT, PFD_PRESS, PFD_PTY };
+    struct pollfd pfds[PFD_PTY + MAX_SESSIONS] = {
+        [PFD_INPUT] = {.fd = li_fd, .events = POLLIN},
+        [PFD_BLANK] = {.fd = blank_tfd, .events = POLLIN},
+        [PFD_FLING] = {.fd = fling_tfd, .events = POLLIN},
+        [PFD_REPEAT] = {.fd = repeat_tfd, .events = POLLIN},
+        [PFD_PRESS] = {.fd = press_tfd, .events = POLLIN}
     };
 
     setgid(32011);
     setuid(32011);
 
+    sigset_t loop_sigs, poll_mask;
+    sigemptyset(&loop_sigs);
+    sigaddset(&loop_sigs, SIGRTMIN);
+    sigaddset(&loop_sigs, SIGRTMIN + 1);
+    sigaddset(&loop_sigs, SIGUSR2);
+    sigaddset(&loop_sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &loop_sigs, &poll_mask);
+
     while (running) {
-        int ret = poll(pfds, 2, -1);
+        vt_process_switch();
+        if (child_req) {
+            child_req = 0;
+            session_reap();
+            if (!nsessions)
+                break;
+        }
+        if (stats_req) {
+            stats_req = 0;
+            dump_stats();
+        }
+        for (int i = 0; i < nsessions; i++) {
+            session_use(i);
+            paste_pump();
+            pty_flush();
+            pfds[PFD_PTY + i].fd = pty_master;
+            pfds[PFD_PTY + i].events = POLLIN | (pty_out.len || paste.buf ? POLLOUT : 0);
+            session_use(i);
+        }
+        fb_flush();
+        int wait_ms = pred_timeout();
+        int sync_ms = sync_timeout();
+        if (sync_ms >= 0 && (wait_ms < 0 || sync_ms < wait_ms))
+            wait_ms = sync_ms;
+        struct timespec wait_ts = {wait_ms / 1000, (wait_ms % 1000) * 1000000L};
+        int ret = ppoll(pfds, PFD_PTY + nsessions, wait_ms >= 0 ? &wait_ts : NULL, &poll_mask);
         if (ret < 0 && errno != EINTR)
             break;
 
@@ -577,96 +4171,199 @@ int main(int argc, char **argv) {
 
         if (force_refresh) {
             force_refresh = 0;
-            ioctl(fb_fd, FBIOPAN_DISPLAY, &vinfo);
+            if (!render_inhibit)
+                ioctl(fb_fd, FBIOPAN_DISPLAY, &vinfo);
             continue;
         }
 
-        if (pfds[1].revents & POLLIN) {
+        if (pfds[PFD_BLANK].revents & POLLIN)
+            blank_timer_expired();
+
+        if (pfds[PFD_FLING].revents & POLLIN)
+            fling_tick();
+
+        if (pfds[PFD_REPEAT].revents & POLLIN)
+            repeat_tick();
+
+        if (pfds[PFD_PRESS].revents & POLLIN)
+            long_press_fired();
+
+        if (pred.n && pred_timeout() == 0) {
+            pred_check();
+            input_processed = 1;
+        }
+
+        for (int i = 0; i < nsessions; i++) {
+            if (!(pfds[PFD_PTY + i].revents & POLLIN)) continue;
             char buf[4096];
             ssize_t n;
+            session_use(i);
             while ((n = read(pty_master, buf, sizeof(buf))) > 0) {
-                tsm_vte_input(tsm_vte, buf, n);
-                input_processed = 1;
+                term_input(buf, n);
+                if (i == cur_session)
+                    input_processed = 1;
             }
+            session_use(i);
+            if (now_ms() - blank_checked_ms > 1000)
+                blank_check();
         }
 
-        if (pfds[0].revents & POLLIN) {
+        if (pfds[PFD_INPUT].revents & POLLIN) {
             libinput_dispatch(li);
+            if (blank_timeout > 0 && !blanked_by_us)
+                blank_idle_rearm();
             struct libinput_event *ev;
             while ((ev = libinput_get_event(li))) {
                 enum libinput_event_type t = libinput_event_get_type(ev);
+                if (t == LIBINPUT_EVENT_KEYBOARD_KEY) {
+                    hw_key(ev);
+                    libinput_event_destroy(ev);
+                    continue;
+                }
+                if (t == LIBINPUT_EVENT_DEVICE_ADDED || t == LIBINPUT_EVENT_DEVICE_REMOVED)
+                    hw_device(libinput_event_get_device(ev), t == LIBINPUT_EVENT_DEVICE_ADDED);
+                if (render_inhibit & INHIBIT_VT) {
+                    libinput_event_destroy(ev);
+                    continue;
+                }
+                if (blanked_by_us) {
+                    if (t == LIBINPUT_EVENT_TOUCH_DOWN)
+                        blank_set(0);
+                    libinput_event_destroy(ev);
+                    continue;
+                }
                 if (t == LIBINPUT_EVENT_TOUCH_DOWN) {
                     struct libinput_event_touch *te = libinput_event_get_touch_event(ev);
                     int tx = libinput_event_touch_get_x_transformed(te, fb_w);
                     int ty = libinput_event_touch_get_y_transformed(te, fb_h);
-                    if (get_key_at(tx, ty, &pressed_row, &pressed_col)) {
-                        handle_key(pressed_row, pressed_col, 1);
+                    fling_stop();
+                    repeat_stop();
+                    if (osk_collapsed && !osk_hidden && ty >= kb_y) {
+                        osk_set(0, 0);
+                    } else if ((pressed_key = get_key_at(tx, ty)) >= 0) {
+                        if (kb->keys[pressed_key].keysym == ' ' && !kb->keys[pressed_key].text)
+                            pad_press(tx, ty);
+                        else if (popup_press(pressed_key))
+                            popup.finger_x = tx;
+                        else if (handle_key(pressed_key, 1))
+                            repeat_start();
                         draw_keyboard();
                         last_touch_y = -1;
+                    } else if ((tsm_screen_get_flags(tsm_screen) & TSM_SCREEN_ALTERNATE) && !sb_count &&
+                               alt_scroll != ALT_SCROLL_OFF &&
+                               (!mouse_active() || alt_scroll == ALT_SCROLL_WHEEL)) {
+                        alt_press(tx, ty, mouse_active());
+                    } else if (mouse_active()) {
+                        mouse_press(tx, ty);
                     } else {
-                        last_touch_y = ty;
+                        sel_press(tx, ty);
+                        last_touch_y = touch_y = ty;
+                        vel.n = 0;
+                        vel_add(libinput_event_touch_get_time_usec(te), ty);
                     }
                 } else if (t == LIBINPUT_EVENT_TOUCH_MOTION) {
                     struct libinput_event_touch *te = libinput_event_get_touch_event(ev);
                     int ty = libinput_event_touch_get_y_transformed(te, fb_h);
-                    if (last_touch_y != -1) {
-                        int dy = ty - last_touch_y;
-                        if (abs(dy) > cell_h) {
-                            if (dy > 0) {
-                                int lines = dy / cell_h;
-                                tsm_screen_sb_up(tsm_screen, lines);
-                                sb_count += lines;
-                                if (sb_count > 1000) sb_count = 1000;
-                            } else {
-                                int lines = -dy / cell_h;
-                                tsm_screen_sb_down(tsm_screen, lines);
-                                sb_count -= lines;
-                                if (sb_count < 0) sb_count = 0;
-                            }
-                            last_touch_y = ty;
-                            input_processed = 1;
+                    if (pad.armed || pad.active) {
+                        pad.x = libinput_event_touch_get_x_transformed(te, fb_w);
+                        pad.y = ty;
+                    }
+                    if (popup.armed || popup.shown)
+                        popup.finger_x = libinput_event_touch_get_x_transformed(te, fb_w);
+                    if (mouse.down) {
+                        mouse.x = libinput_event_touch_get_x_transformed(te, fb_w);
+                        mouse.y = ty;
+                    }
+                    if (alt.active)
+                        alt.y = ty;
+                    if (sel.pending || sel.dragging) {
+                        int tx = libinput_event_touch_get_x_transformed(te, fb_w);
+                        if (sel.pending && (abs(tx - sel.x) > cell_h / 2 || abs(ty - sel.y) > cell_h / 2))
+                            sel.pending = 0;
+                        if (sel.dragging) {
+                            sel.x = tx;
+                            sel.y = ty;
                         }
                     }
+                    if (last_touch_y != -1) {
+                        touch_y = ty;
+                        vel_add(libinput_event_touch_get_time_usec(te), ty);
+                    }
                 } else if (t == LIBINPUT_EVENT_TOUCH_UP) {
+                    if (mouse.down)
+                        mouse_release();
+                    if (alt.active)
+                        alt_release();
+                    if (sel.pending || sel.dragging)
+                        sel_release();
+                    if (last_touch_y != -1) {
+                        struct libinput_event_touch *te = libinput_event_get_touch_event(ev);
+                        drag_apply();
+                        if (!fling_start(vel_estimate(libinput_event_touch_get_time_usec(te))))
+                            scroll_snap();
+                    }
                     last_touch_y = -1;
-                    if (pressed_row >= 0) {
-                        handle_key(pressed_row, pressed_col, 0);
-                        pressed_row = -1;
-                        pressed_col = -1;
-                        draw_keyboard();
+                    if (pressed_key >= 0) {
+                        int popped = popup.shown;
+                        repeat_stop();
+                        if (pad.armed || pad.active)
+                            pad_release();
+                        if (popup.armed || popup.shown)
+                            popup_release();
+                        handle_key(pressed_key, 0);
+                        pressed_key = -1;
+                        if (popped)
+                            draw_key(popup.key);
+                        else
+                            draw_keyboard();
                     }
                 }
                 libinput_event_destroy(ev);
             }
+
+            drag_apply();
+            pad_apply();
+            popup_apply();
+            mouse_apply();
+            alt_apply();
+            sel_apply();
         }
 
-        if (input_processed) {
-            draw_terminal();
+        if (sync_timeout() == 0) {
+            term_modes &= ~MODE_SYNC;
+            sync_out.timeouts++;
+        }
+
+        if (input_processed)
+            term_damaged = 1;
+        if (term_damaged && (term_modes & MODE_SYNC)) {
+            sync_out.deferred++;
+        } else if (term_damaged && !popup.shown) {
+            term_damaged = 0;
+            draw_terminal_damage();
         }
     }
 
-    kill(child_pid, SIGHUP);
-    close(pty_master);
-    tsm_vte_unref(tsm_vte);
-    tsm_screen_unref(tsm_screen);
+    for (int i = 0; i < nsessions; i++) {
+        session_use(i);
+        kill(child_pid, SIGHUP);
+        session_free();
+        session_use(i);
+    }
     libinput_unref(li);
+    hw_free();
     udev_unref(udev);
     glyph_cache_clear();
     if (font_data != font_ttf)
         free(font_data);
 
-    if (active_vt != -1) {
-        char tty_path[32];
-        snprintf(tty_path, sizeof(tty_path), "/dev/tty%d", active_vt);
-        int vt_fd = open(tty_path, O_RDWR | O_NOCTTY);
-        if (vt_fd >= 0) {
-            ioctl(vt_fd, KDSETMODE, KD_TEXT);
-            close(vt_fd);
-        }
-    }
+    if (blanked_by_us)
+        ioctl(fb_fd, FBIOBLANK, FB_BLANK_UNBLANK);
+    vt_restore();
 
     if (fb_mem != MAP_FAILED && fb_mem != NULL)
         munmap(fb_mem, fb_h * fb_stride);
+    free(fb_shadow);
     if (fb_fd >= 0)
         close(fb_fd);
     return 0;